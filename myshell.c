@@ -10,570 +10,4676 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <ftw.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-// *** Code taken from treecopy.c 
+// read exactly len bytes, retrying on EINTR and short reads
+// returns the number of bytes read, which is less than len only at end of file, or -1 on error
+ssize_t read_all(int fd, void *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t read_ret = read(fd, (char *)buf + total, len - total);
+        if (read_ret < 0)
+        {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        if (!read_ret) break;
+        total += read_ret;
+    }
+    return total;
+}
 
-// struct used to store how many directory and files have been copied as well as the number of bytes copied
-typedef struct copy_info
+// write exactly len bytes, retrying on EINTR and short writes. returns 0 on success and -1 on error
+int write_all(int fd, const void *buf, size_t len)
 {
-    int num_dir;
-    int num_files;
-    int num_bytes;
-} copy_info;
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t write_ret = write(fd, (const char *)buf + total, len - total);
+        if (write_ret < 0)
+        {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        total += write_ret;
+    }
+    return 0;
+}
 
-// arguments are the source file path and the destination file path, and copies a single file,
-// also updates copy_info
-// *** whenever we get an error with a systemcall, we do not continue but attempt to close as many files and free as much allocated memory as possible
-// if these actions also have an error (like we cant close a file), something is seriously wrong and we exit
-// this is why there is nested error cases for the system calls 
-int filecopy(const char *source, const char *dest, copy_info *copy_info)
+double monotonic_seconds()
 {
-    // open file to copy
-    int input_fd = open(source, O_RDONLY, 0);
-    if ( input_fd < 0 ) {
-        fprintf(stderr, "copy: Unable to open file %s: %s\n", source, strerror(errno));
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// fnv-1a hash used by the hash tables below
+uint32_t string_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) { hash = (hash ^ (unsigned char)*name) * 16777619u; }
+    return hash;
+}
+
+// *** Tracing
+
+// trace on FILE records a span for each call to the functions marked with TRACE_SPAN and trace off writes them
+// to FILE as chrome trace events. every thread records into a buffer of its own, buffers are kept on a lock free
+// list and are handed on to new threads once their thread exits. while tracing is off a span is one load and branch,
+// and building with -DMYSHELL_NO_TRACE (make myshell-notrace) removes the spans entirely to measure that against
+#define TRACE_BUFFER_EVENTS 16384
+
+#ifdef MYSHELL_NO_TRACE
+#define TRACE_SPAN(name) (void)0
+#else
+#define TRACE_SPAN(name) __attribute__((cleanup(trace_end))) trace_span trace_span_local = {trace_begin(), name}
+#endif
+
+typedef struct trace_event
+{
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t tid;
+} trace_event;
+
+// a span being timed, recorded when the variable goes out of scope
+typedef struct trace_span
+{
+    uint64_t start_ns; // 0 when tracing was off as the span started
+    const char *name;
+} trace_span;
+
+typedef struct trace_events
+{
+    uint32_t count;
+    uint64_t dropped;
+    trace_event events[TRACE_BUFFER_EVENTS];
+} trace_events;
+
+// the owning thread records into active. trace_stop swaps in spare and waits for busy to clear before reading the
+// old events, so a span being recorded as tracing stops is never lost or carried into the next session
+typedef struct trace_buffer
+{
+    struct trace_buffer *next;
+    int owned; // 1 while a live thread is recording into it
+    int busy; // 1 while the owner is recording a span
+    trace_events *active;
+    trace_events *spare; // only touched by trace_start and trace_stop
+} trace_buffer;
+
+int trace_enabled;
+FILE *trace_file;
+char *trace_path;
+trace_buffer *trace_buffers;
+pthread_key_t trace_key;
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+uint64_t trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t trace_begin()
+{
+    return __builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0) ? trace_now() : 0;
+}
+
+void trace_release(void *buffer)
+{
+    __atomic_store_n(&((trace_buffer *)buffer)->owned, 0, __ATOMIC_RELEASE);
+}
+
+void trace_init()
+{
+    pthread_key_create(&trace_key, trace_release);
+}
+
+// the calling thread's buffer: one left behind by a finished thread if there is one, otherwise a new one
+trace_buffer *trace_local_buffer()
+{
+    pthread_once(&trace_once, trace_init);
+    trace_buffer *buffer = pthread_getspecific(trace_key);
+    if (buffer != NULL) { return buffer; }
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+    {
+        int free_buffer = 0;
+        if (__atomic_compare_exchange_n(&buffer->owned, &free_buffer, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (buffer == NULL)
+    {
+        buffer = calloc(1, sizeof(trace_buffer));
+        trace_events *active = calloc(1, sizeof(trace_events));
+        trace_events *spare = calloc(1, sizeof(trace_events));
+        if (buffer == NULL || active == NULL || spare == NULL)
+        {
+            free(buffer);
+            free(active);
+            free(spare);
+            return NULL;
+        }
+        buffer->active = active;
+        buffer->spare = spare;
+        buffer->owned = 1;
+        buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+    pthread_setspecific(trace_key, buffer);
+    return buffer;
+}
+
+void trace_record(const char *name, uint64_t start_ns)
+{
+    uint64_t end_ns = trace_now();
+    trace_buffer *buffer = trace_local_buffer();
+    if (buffer == NULL) { return; }
+    __atomic_store_n(&buffer->busy, 1, __ATOMIC_SEQ_CST); // pairs with the exchange in trace_take
+    trace_events *events = __atomic_load_n(&buffer->active, __ATOMIC_SEQ_CST);
+    if (events->count == TRACE_BUFFER_EVENTS) { events->dropped++; }
+    else { events->events[events->count++] = (trace_event){name, start_ns, end_ns - start_ns, syscall(SYS_gettid)}; }
+    __atomic_store_n(&buffer->busy, 0, __ATOMIC_RELEASE);
+}
+
+// takes the events recorded into buffer so far, leaving its owner an empty set to record into
+trace_events *trace_take(trace_buffer *buffer)
+{
+    trace_events *events = __atomic_exchange_n(&buffer->active, buffer->spare, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&buffer->busy, __ATOMIC_ACQUIRE)) { sched_yield(); } // a record into events may be finishing
+    return events;
+}
+
+// gives events back to buffer as its spare once they have been read
+void trace_give_back(trace_buffer *buffer, trace_events *events)
+{
+    events->count = 0;
+    events->dropped = 0;
+    buffer->spare = events;
+}
+
+// cleanup handler for TRACE_SPAN
+void trace_end(trace_span *span)
+{
+    if (__builtin_expect(span->start_ns != 0, 0)) { trace_record(span->name, span->start_ns); }
+}
+
+int trace_start(const char *path)
+{
+    if (trace_enabled)
+    {
+        fprintf(stderr, "trace: already tracing to %s\n", trace_path);
+        return 1;
+    }
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL)
+    {
+        fprintf(stderr, "trace: Unable to create file %s: %s\n", path, strerror(errno));
         return 1;
     }
+    trace_path = strdup(path);
+    // drop spans that ended after the last session stopped, they belong to neither
+    for (trace_buffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+    {
+        trace_give_back(buffer, trace_take(buffer));
+    }
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    // open file destination and copy permissions
-    struct stat stat_buffer;
-    int stat_err = stat(source, &stat_buffer);
-    if ( stat_err == -1 ) {
-        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source, strerror(errno));
-        int close_err = close(input_fd);
-        if ( close_err < 0 ) { // something seriously wrong happened
-            fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-            exit(1);
-        }
-	    return 1;
+// stop tracing and write every recorded span out as a chrome trace event
+int trace_stop()
+{
+    if (!trace_enabled)
+    {
+        fprintf(stderr, "trace: tracing is not on\n");
+        return 1;
     }
-    // create destination file
-    int dest_fd = open(dest, O_CREAT|O_WRONLY, stat_buffer.st_mode);
-    if ( dest_fd < 0 ) {
-        fprintf(stderr, "copy: Unable to create file %s: %s\n", dest, strerror(errno));
-	    int close_err = close(input_fd);
-        if ( close_err < 0 ) { // something seriously wrong happened
-            fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-            exit(1);
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    fprintf(trace_file, "{\"traceEvents\":[");
+    uint64_t num_events = 0;
+    uint64_t dropped = 0;
+    int pid = getpid();
+    for (trace_buffer *buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next)
+    {
+        trace_events *events = trace_take(buffer);
+        for (uint32_t i = 0; i < events->count; i++, num_events++)
+        {
+            trace_event *event = &events->events[i];
+            fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                    num_events ? "," : "", event->name, event->start_ns / 1000.0, event->duration_ns / 1000.0, pid, event->tid);
         }
-	    return 1;
+        dropped += events->dropped;
+        trace_give_back(buffer, events);
     }
+    fprintf(trace_file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    int stop_ret = 0;
+    if (fclose(trace_file) == EOF)
+    {
+        fprintf(stderr, "trace: Unable to write file %s: %s\n", trace_path, strerror(errno));
+        stop_ret = 1;
+    }
+    else
+    {
+        printf("trace: wrote %llu events to %s", (unsigned long long)num_events, trace_path);
+        if (dropped) { printf(", %llu dropped because a buffer was full", (unsigned long long)dropped); }
+        printf("\n");
+    }
+    trace_file = NULL;
+    free(trace_path);
+    trace_path = NULL;
+    return stop_ret;
+}
 
-    char buffer[4096]; // read in source file in 4kb chunks
-    // ints to store return values from the read and write system calls
-    int read_ret;
-    int write_ret;
-    int total_bytes_written = 0;
+// *** Logging
+
+// copy output goes through a lock free ring of slots that any thread can fill, and a single writer thread
+// drains the ring into a large buffer and writes it to stdout in big chunks
+// log_at checks the level before anything is formatted, so quiet copies never touch the ring
+#define LOG_QUIET 0
+#define LOG_SUMMARY 1
+#define LOG_FILES 2
+#define LOG_RING_SLOTS 4096 // must be a power of two
+#define LOG_SLOT_SIZE 240
+#define LOG_WRITE_SIZE (64 * 1024)
+
+#define log_at(level, ...) do { if (log_level >= (level)) { log_printf(__VA_ARGS__); } } while (0)
+
+typedef struct log_slot
+{
+    uint64_t sequence; // tells producers and the writer whose turn it is to use the slot
+    char *long_text; // messages that do not fit in text are allocated and freed by the writer
+    char text[LOG_SLOT_SIZE];
+} log_slot;
+
+int log_level = LOG_FILES;
+log_slot log_ring[LOG_RING_SLOTS];
+uint64_t log_enqueue_pos;
+uint64_t log_dequeue_pos;
+uint64_t log_written_pos; // every message before this one has reached stdout
+int log_writer_sleeping;
+pthread_once_t log_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wakeup = PTHREAD_COND_INITIALIZER;
+
+void *log_writer_main(void *arg)
+{
+    char *buffer = malloc(LOG_WRITE_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "myshell: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    size_t used = 0;
+    uint64_t pos = 0;
     while (1)
     {
-        // attempt to read in a chunk from the source file
-        // 4 cases: read_ret = 4096, read_ret < 4096, read_ret = 0, read_ret is less than 1
-        read_ret = read(input_fd, buffer, 4096);
-        if ( read_ret < 0 ) {
-            if (errno == EINTR) { continue; } // if we encounter an interrupt error, go back to the start of the loop and try to read again
-            // if we get a fatal error, attempt to close the files and return
-            fprintf(stderr, "copy: Unable to read from file %s: %s\n", source, strerror(errno));
-            int close_err = close(input_fd);
-            if ( close_err < 0 ) {
-                fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-                exit(1);
+        log_slot *slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1) // a message is waiting
+        {
+            const char *text = slot->long_text ? slot->long_text : slot->text;
+            size_t len = strlen(text);
+            if (used + len > LOG_WRITE_SIZE && used)
+            {
+                write_all(STDOUT_FILENO, buffer, used);
+                used = 0;
             }
-            close_err = close(dest_fd);
-            if ( close_err < 0 ) {
-                fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
-                exit(1);
+            if (len > LOG_WRITE_SIZE) { write_all(STDOUT_FILENO, text, len); }
+            else
+            {
+                memcpy(buffer + used, text, len);
+                used += len;
             }
-            return 1;
+            free(slot->long_text);
+            slot->long_text = NULL;
+            __atomic_store_n(&slot->sequence, pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+            pos++;
+            __atomic_store_n(&log_dequeue_pos, pos, __ATOMIC_RELEASE);
+            continue;
         }
-        if (!read_ret) break; // we have reached the end of the file
-        
-        // try to write to destination file
-        write_ret = write(dest_fd, buffer, read_ret);
-        if ( write_ret < 0 ) {
-            if (errno == EINTR) {} // if we get interrupted while trying to write, we try to finish the write in the code block below
+        // the ring is empty, write out what we have and go to sleep until a producer wakes us up
+        if (used)
+        {
+            write_all(STDOUT_FILENO, buffer, used);
+            used = 0;
+        }
+        __atomic_store_n(&log_written_pos, pos, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&log_mutex);
+        __atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != pos + 1)
+        {
+            pthread_cond_wait(&log_wakeup, &log_mutex);
+        }
+        __atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&log_mutex);
+    }
+    return NULL;
+}
+
+void log_start()
+{
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) { log_ring[i].sequence = i; }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer_main, NULL))
+    {
+        fprintf(stderr, "myshell: unable to start log writer: %s\n", strerror(errno));
+        exit(1);
+    }
+    pthread_detach(writer);
+}
+
+// format a message into the next free slot of the ring. safe to call from any thread
+void log_printf(const char *format, ...)
+{
+    pthread_once(&log_once, log_start);
+    // claim a slot, waiting for the writer if the ring is full
+    uint64_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    log_slot *slot;
+    while (1)
+    {
+        slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if (diff < 0)
+        {
+            sched_yield();
+            pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+        else { pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED); }
+    }
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(slot->text, LOG_SLOT_SIZE, format, args);
+    va_end(args);
+    if (len >= LOG_SLOT_SIZE)
+    {
+        va_start(args, format);
+        if (vasprintf(&slot->long_text, format, args) < 0) { slot->long_text = NULL; }
+        va_end(args);
+    }
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&log_mutex);
+        pthread_cond_signal(&log_wakeup);
+        pthread_mutex_unlock(&log_mutex);
+    }
+}
+
+// wait until everything logged so far has been written, so it does not get mixed up with the next prompt
+void log_flush()
+{
+    uint64_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&log_written_pos, __ATOMIC_ACQUIRE) < pos)
+    {
+        struct timespec pause = {0, 50000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+// *** LZ compression
+
+// compressed streams start with LZ_MAGIC and are a series of blocks, each one prefixed by two uint32s:
+// the uncompressed size and the stored size, with LZ_STORED_FLAG set in the stored size when the block did not
+// compress and is kept as is. a block with an uncompressed size of 0 ends the stream
+// blocks are independent of each other so a batch of them can be compressed on every core at once
+#define LZ_MAGIC "MYLZ0001"
+#define LZ_BLOCK_SIZE (256 * 1024)
+#define LZ_STORED_FLAG 0x80000000u
+#define LZ_MAX_THREADS 16
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+
+// how much data went through a compressor or decompressor and how long it took
+typedef struct lz_stats
+{
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+    uint64_t blocks;
+    uint64_t raw_blocks; // blocks that were incompressible and stored as is
+    double seconds;
+} lz_stats;
+
+uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// write a literal or match length that did not fit in its 4 bits of the token
+size_t lz_put_length(uint8_t *dst, size_t op, size_t length)
+{
+    while (length >= 255)
+    {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+// emit one sequence: a run of literals followed by a match (match_len 0 for the final literals)
+// returns the new output position or 0 if it would not fit within cap
+size_t lz_emit(uint8_t *dst, size_t op, size_t cap, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len)
+{
+    size_t need = 1 + literal_len / 255 + 1 + literal_len + (match_len ? 2 + (match_len - LZ_MIN_MATCH) / 255 + 1 : 0);
+    if (op + need > cap) { return 0; }
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    dst[op++] = ((literal_len < 15 ? literal_len : 15) << 4) | (match_code < 15 ? match_code : 15);
+    if (literal_len >= 15) { op = lz_put_length(dst, op, literal_len - 15); }
+    memcpy(dst + op, literals, literal_len);
+    op += literal_len;
+    if (match_len)
+    {
+        dst[op++] = offset & 0xff;
+        dst[op++] = offset >> 8;
+        if (match_code >= 15) { op = lz_put_length(dst, op, match_code - 15); }
+    }
+    return op;
+}
+
+// compress n bytes of src into dst, a single pass LZ77 over a 64kb window using a hash of the next 4 bytes
+// gives up and returns 0 as soon as the output would not be smaller than cap, so incompressible data costs little
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+    if (n >= 12)
+    {
+        size_t limit = n - 12; // the last bytes are always literals so matches never run off the end
+        while (ip < limit)
+        {
+            uint32_t sequence = lz_read32(src + ip);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+            size_t ref = table[hash];
+            table[hash] = ip;
+            if (ref < ip && ip - ref <= 65535 && lz_read32(src + ref) == sequence)
+            {
+                size_t match_len = LZ_MIN_MATCH;
+                while (ip + match_len < n - 5 && src[ref + match_len] == src[ip + match_len]) { match_len++; }
+                op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len);
+                if (!op) { return 0; }
+                ip += match_len;
+                anchor = ip;
+            }
             else
             {
-                // if we get a fatal error, attempt to close the files and return
-                fprintf(stderr, "copy: Unable to write to file %s: %s\n", dest, strerror(errno));
-                int close_err = close(input_fd);
-                if ( close_err < 0 ) {
-                    fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-                    exit(1);
-                }
-                close_err = close(dest_fd);
-                if ( close_err < 0 ) {
-                    fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
-                    exit(1);
-                }
-                return 1;
+                ip += 1 + ((ip - anchor) >> 6); // step faster through data that keeps missing
             }
         }
-        // if we are unable to write all the bytes, keep trying until we get a hard error
-        int current_bytes_written = write_ret;
-        if (current_bytes_written < 0) { current_bytes_written = 0; } // special case for EINTR: 0 bytes were written in that case
-        while (current_bytes_written < read_ret)
+    }
+    op = lz_emit(dst, op, cap, src + anchor, n - anchor, 0, 0);
+    if (!op || op >= n) { return 0; }
+    return op;
+}
+
+// decompress a block produced by lz_compress into exactly raw_size bytes. returns 0 on success and -1 if it is corrupt
+int lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_size)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < n)
+    {
+        uint8_t token = src[ip++];
+        size_t literal_len = token >> 4;
+        if (literal_len == 15)
         {
-            write_ret = write(dest_fd, buffer, read_ret);
-            if ( write_ret < 0 ) {
-                if (errno == EINTR) { continue; } // if we encounter another EINTR, try again
-                else // if we encounter a fatal error 
-                {
-                    // if we get a fatal error, attempt to close the files and return
-                    fprintf(stderr, "copy: Unable to write to file %s: %s\n", source, strerror(errno));
-                    int close_err = close(input_fd);
-                    if ( close_err < 0 ) {
-                        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-                        exit(1);
-                    }
-                    close_err = close(dest_fd);
-                    if ( close_err < 0 ) {
-                        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
-                        exit(1);
-                    }
-                    return 1;
+            uint8_t extra;
+            do {
+                if (ip >= n) { return -1; }
+                extra = src[ip++];
+                literal_len += extra;
+            } while (extra == 255);
+        }
+        if (literal_len > n - ip || literal_len > raw_size - op) { return -1; }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == n) break; // the last sequence has no match
+        if (n - ip < 2) { return -1; }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15)
+        {
+            uint8_t extra;
+            do {
+                if (ip >= n) { return -1; }
+                extra = src[ip++];
+                match_len += extra;
+            } while (extra == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > raw_size - op) { return -1; }
+        for (size_t i = 0; i < match_len; i++, op++) { dst[op] = dst[op - offset]; } // matches may overlap themselves
+    }
+    return op == raw_size ? 0 : -1;
+}
+
+// one block of a batch being compressed by the worker threads
+typedef struct lz_block
+{
+    const uint8_t *raw;
+    uint32_t raw_size;
+    uint8_t *out;
+    uint32_t out_size; // 0 when the block did not compress
+} lz_block;
+
+typedef struct lz_worker
+{
+    lz_block *blocks;
+    int num_blocks;
+    int first;
+    int stride;
+} lz_worker;
+
+void *lz_worker_main(void *arg)
+{
+    lz_worker *worker = arg;
+    for (int i = worker->first; i < worker->num_blocks; i += worker->stride)
+    {
+        lz_block *block = &worker->blocks[i];
+        block->out_size = lz_compress(block->raw, block->raw_size, block->out, block->raw_size);
+    }
+    return NULL;
+}
+
+// buffered output stage. with compress set, data is cut into blocks and compressed a batch at a time,
+// one block per core, before being written in order. without it writes go straight to fd.
+// the buffers start out sized for the expected output and only grow to a full batch if more arrives
+typedef struct lz_writer
+{
+    int fd;
+    const char *name;
+    int compress;
+    int num_threads;
+    uint8_t *buffer;
+    size_t used;
+    size_t capacity;
+    size_t max_capacity; // a full batch, two blocks per thread
+    uint8_t *out;
+    lz_stats *stats;
+} lz_writer;
+
+// size_hint is how many bytes the caller expects to write, 0 if it does not know
+int lz_writer_open(lz_writer *writer, int fd, const char *name, int compress, uint64_t size_hint, lz_stats *stats)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    writer->name = name;
+    writer->compress = compress;
+    writer->stats = stats;
+    if (!compress) { return 0; }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    writer->num_threads = cpus < 1 ? 1 : (cpus > LZ_MAX_THREADS ? LZ_MAX_THREADS : cpus);
+    writer->max_capacity = (size_t)writer->num_threads * 2 * LZ_BLOCK_SIZE;
+    uint64_t blocks = size_hint ? (size_hint + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE : 1;
+    writer->capacity = blocks * LZ_BLOCK_SIZE < writer->max_capacity ? blocks * LZ_BLOCK_SIZE : writer->max_capacity;
+    writer->buffer = malloc(writer->capacity);
+    writer->out = malloc(writer->capacity);
+    if (writer->buffer == NULL || writer->out == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    if (write_all(fd, LZ_MAGIC, 8) < 0)
+    {
+        fprintf(stderr, "copy: Unable to write to file %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// compress everything buffered so far across the worker threads and write the blocks out in order
+int lz_flush(lz_writer *writer)
+{
+    TRACE_SPAN("lz_flush");
+    if (!writer->used) { return 0; }
+    double start = monotonic_seconds();
+    lz_block blocks[LZ_MAX_THREADS * 2];
+    int num_blocks = 0;
+    for (size_t offset = 0; offset < writer->used; offset += LZ_BLOCK_SIZE, num_blocks++)
+    {
+        size_t size = writer->used - offset < LZ_BLOCK_SIZE ? writer->used - offset : LZ_BLOCK_SIZE;
+        blocks[num_blocks].raw = writer->buffer + offset;
+        blocks[num_blocks].raw_size = size;
+        blocks[num_blocks].out = writer->out + offset;
+    }
+    // a single block (any small file) is compressed right here without starting a thread
+    int num_threads = num_blocks < writer->num_threads ? num_blocks : writer->num_threads;
+    pthread_t threads[LZ_MAX_THREADS];
+    lz_worker workers[LZ_MAX_THREADS];
+    int created[LZ_MAX_THREADS] = {0};
+    for (int i = 0; i < num_threads; i++)
+    {
+        workers[i] = (lz_worker){blocks, num_blocks, i, num_threads};
+        if (i > 0) { created[i] = pthread_create(&threads[i], NULL, lz_worker_main, &workers[i]) == 0; }
+    }
+    lz_worker_main(&workers[0]);
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (created[i]) { pthread_join(threads[i], NULL); }
+        else { lz_worker_main(&workers[i]); } // could not start this thread so do its share here
+    }
+
+    for (int i = 0; i < num_blocks; i++)
+    {
+        uint32_t frame[2];
+        frame[0] = blocks[i].raw_size;
+        const uint8_t *data = blocks[i].out;
+        uint32_t size = blocks[i].out_size;
+        if (!size) // incompressible blocks are stored as is
+        {
+            data = blocks[i].raw;
+            size = blocks[i].raw_size;
+            frame[1] = size | LZ_STORED_FLAG;
+            writer->stats->raw_blocks++;
+        }
+        else { frame[1] = size; }
+        if (write_all(writer->fd, frame, sizeof(frame)) < 0 || write_all(writer->fd, data, size) < 0)
+        {
+            fprintf(stderr, "copy: Unable to write to file %s: %s\n", writer->name, strerror(errno));
+            return 1;
+        }
+        writer->stats->blocks++;
+        writer->stats->raw_bytes += blocks[i].raw_size;
+        writer->stats->stored_bytes += size + sizeof(frame);
+    }
+    writer->stats->seconds += monotonic_seconds() - start;
+    writer->used = 0;
+    return 0;
+}
+
+int lz_write(lz_writer *writer, const void *buf, size_t len)
+{
+    if (!writer->compress)
+    {
+        if (write_all(writer->fd, buf, len) < 0)
+        {
+            fprintf(stderr, "copy: Unable to write to file %s: %s\n", writer->name, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    while (len > 0)
+    {
+        size_t chunk = writer->capacity - writer->used < len ? writer->capacity - writer->used : len;
+        memcpy(writer->buffer + writer->used, buf, chunk);
+        writer->used += chunk;
+        buf = (const char *)buf + chunk;
+        len -= chunk;
+        if (writer->used < writer->capacity) { continue; }
+        if (writer->capacity < writer->max_capacity) // more than expected, grow towards a full batch before flushing
+        {
+            size_t capacity = writer->capacity * 2 < writer->max_capacity ? writer->capacity * 2 : writer->max_capacity;
+            uint8_t *buffer = realloc(writer->buffer, capacity);
+            if (buffer != NULL) { writer->buffer = buffer; }
+            uint8_t *out = buffer != NULL ? realloc(writer->out, capacity) : NULL;
+            if (out != NULL)
+            {
+                writer->out = out;
+                writer->capacity = capacity;
+                continue;
+            }
+        }
+        if (lz_flush(writer)) { return 1; } // could not grow, a smaller batch still works
+    }
+    return 0;
+}
+
+// flush what is left and end the stream. the descriptor is left open for the caller
+int lz_writer_close(lz_writer *writer)
+{
+    int close_ret = 0;
+    if (writer->compress)
+    {
+        uint32_t end[2] = {0, 0};
+        close_ret = lz_flush(writer);
+        if (!close_ret && write_all(writer->fd, end, sizeof(end)) < 0)
+        {
+            fprintf(stderr, "copy: Unable to write to file %s: %s\n", writer->name, strerror(errno));
+            close_ret = 1;
+        }
+        if (!close_ret) { writer->stats->stored_bytes += 8 + sizeof(end); }
+    }
+    free(writer->buffer);
+    free(writer->out);
+    writer->buffer = NULL;
+    writer->out = NULL;
+    return close_ret;
+}
+
+// input stage matching lz_writer. with detect set, a stream starting with LZ_MAGIC is decompressed block by block
+// and anything else is passed through untouched
+typedef struct lz_reader
+{
+    int fd;
+    const char *name;
+    int compressed;
+    int done;
+    uint8_t *raw; // decompressed block, or the bytes read while looking for the magic
+    size_t raw_len;
+    size_t raw_pos;
+    uint8_t *in;
+    lz_stats *stats;
+} lz_reader;
+
+int lz_reader_open(lz_reader *reader, int fd, const char *name, int detect, lz_stats *stats)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->name = name;
+    reader->stats = stats;
+    if (!detect) { return 0; }
+    reader->raw = malloc(LZ_BLOCK_SIZE);
+    reader->in = malloc(LZ_BLOCK_SIZE);
+    if (reader->raw == NULL || reader->in == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    ssize_t read_ret = read_all(fd, reader->raw, 8);
+    if (read_ret < 0)
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    if (read_ret == 8 && !memcmp(reader->raw, LZ_MAGIC, 8))
+    {
+        reader->compressed = 1;
+        reader->stats->stored_bytes += 8; // framing is counted the same way lz_writer_close counts it
+    }
+    else { reader->raw_len = read_ret; }
+    return 0;
+}
+
+// decompress the next block into raw. returns 0 on success and 1 on error
+int lz_next_block(lz_reader *reader)
+{
+    uint32_t frame[2];
+    ssize_t read_ret = read_all(reader->fd, frame, sizeof(frame));
+    if (read_ret < 0)
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: %s\n", reader->name, strerror(errno));
+        return 1;
+    }
+    uint32_t size = frame[1] & ~LZ_STORED_FLAG;
+    if (read_ret != sizeof(frame) || frame[0] > LZ_BLOCK_SIZE || size > LZ_BLOCK_SIZE)
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: compressed stream is truncated or corrupt\n", reader->name);
+        return 1;
+    }
+    reader->raw_pos = 0;
+    reader->raw_len = 0;
+    if (!frame[0])
+    {
+        reader->done = 1;
+        reader->stats->stored_bytes += sizeof(frame);
+        return 0;
+    }
+    uint8_t *dest = (frame[1] & LZ_STORED_FLAG) ? reader->raw : reader->in;
+    if (read_all(reader->fd, dest, size) != size)
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: compressed stream is truncated\n", reader->name);
+        return 1;
+    }
+    double start = monotonic_seconds();
+    if (!(frame[1] & LZ_STORED_FLAG) && lz_decompress(reader->in, size, reader->raw, frame[0]))
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: compressed block is corrupt\n", reader->name);
+        return 1;
+    }
+    if ((frame[1] & LZ_STORED_FLAG) && size != frame[0])
+    {
+        fprintf(stderr, "copy: Unable to read from file %s: compressed block is corrupt\n", reader->name);
+        return 1;
+    }
+    reader->raw_len = frame[0];
+    reader->stats->seconds += monotonic_seconds() - start;
+    reader->stats->blocks++;
+    reader->stats->raw_bytes += frame[0];
+    reader->stats->stored_bytes += size + sizeof(frame);
+    if (frame[1] & LZ_STORED_FLAG) { reader->stats->raw_blocks++; }
+    return 0;
+}
+
+// read up to len bytes, returning fewer only at the end of the stream, or -1 after printing an error
+ssize_t lz_read(lz_reader *reader, void *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        if (reader->raw_pos < reader->raw_len)
+        {
+            size_t chunk = reader->raw_len - reader->raw_pos < len - total ? reader->raw_len - reader->raw_pos : len - total;
+            memcpy((char *)buf + total, reader->raw + reader->raw_pos, chunk);
+            reader->raw_pos += chunk;
+            total += chunk;
+            continue;
+        }
+        if (!reader->compressed)
+        {
+            ssize_t read_ret = read_all(reader->fd, (char *)buf + total, len - total);
+            if (read_ret < 0)
+            {
+                fprintf(stderr, "copy: Unable to read from file %s: %s\n", reader->name, strerror(errno));
+                return -1;
+            }
+            return total + read_ret;
+        }
+        if (reader->done) break;
+        if (lz_next_block(reader)) { return -1; }
+    }
+    return total;
+}
+
+void lz_reader_close(lz_reader *reader)
+{
+    free(reader->raw);
+    free(reader->in);
+    reader->raw = NULL;
+    reader->in = NULL;
+}
+
+// print how well a stream compressed and how fast
+void lz_report(const char *verb, lz_stats *stats)
+{
+    if (!stats->blocks) { return; }
+    double ratio = stats->stored_bytes ? (double)stats->raw_bytes / stats->stored_bytes : 0;
+    double rate = stats->seconds > 0 ? stats->raw_bytes / stats->seconds / (1024 * 1024) : 0;
+    log_at(LOG_SUMMARY, "copy: %s %llu bytes, %llu bytes compressed (ratio %.2f) at %.1f MB/s, %llu of %llu blocks stored uncompressed\n",
+            verb, (unsigned long long)stats->raw_bytes, (unsigned long long)stats->stored_bytes, ratio, rate,
+            (unsigned long long)stats->raw_blocks, (unsigned long long)stats->blocks);
+}
+
+// *** Copy progress
+
+// progress bar drawn on stderr while a copy runs, the totals come from a du scan of the source done beforehand
+typedef struct copy_progress
+{
+    uint64_t total_bytes;
+    uint64_t total_files;
+    uint64_t done_bytes;
+    uint64_t done_files;
+    double start;
+    double last_draw;
+    int drawing;
+} copy_progress;
+
+void progress_draw(copy_progress *progress, double now)
+{
+    if (!isatty(STDERR_FILENO)) { return; }
+    double fraction = progress->total_bytes ? (double)progress->done_bytes / progress->total_bytes : 1;
+    if (fraction > 1) { fraction = 1; }
+    char bar[31];
+    int filled = fraction * 30;
+    memset(bar, '#', filled);
+    memset(bar + filled, ' ', 30 - filled);
+    bar[30] = '\0';
+    double elapsed = now - progress->start;
+    double rate = elapsed > 0 ? progress->done_bytes / elapsed : 0;
+    uint64_t remaining = progress->total_bytes > progress->done_bytes ? progress->total_bytes - progress->done_bytes : 0;
+    double eta = rate > 0 ? remaining / rate : 0;
+    fprintf(stderr, "\rcopy: [%s] %3d%% %llu/%llu files, %.1f/%.1f MB, %.1f MB/s, ETA %.0fs ",
+            bar, (int)(fraction * 100), (unsigned long long)progress->done_files, (unsigned long long)progress->total_files,
+            progress->done_bytes / 1048576.0, progress->total_bytes / 1048576.0, rate / 1048576.0, eta);
+}
+
+// count bytes and finished files toward the bar, redrawing it at most ten times a second
+void progress_update(copy_progress *progress, uint64_t bytes, int files)
+{
+    if (progress == NULL) { return; }
+    __atomic_add_fetch(&progress->done_bytes, bytes, __ATOMIC_RELAXED); // parallel batch copies share one bar
+    __atomic_add_fetch(&progress->done_files, files, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&progress->drawing, 1, __ATOMIC_ACQUIRE)) { return; } // another thread is drawing it
+    double now = monotonic_seconds();
+    if (now - progress->last_draw >= 0.1)
+    {
+        progress->last_draw = now;
+        progress_draw(progress, now);
+    }
+    __atomic_store_n(&progress->drawing, 0, __ATOMIC_RELEASE);
+}
+
+void progress_finish(copy_progress *progress)
+{
+    if (progress == NULL) { return; }
+    progress_draw(progress, monotonic_seconds());
+    if (isatty(STDERR_FILENO)) { fprintf(stderr, "\n"); }
+}
+
+// *** Code taken from treecopy.c 
+
+// struct used to store how many directory and files have been copied as well as the number of bytes copied
+typedef struct copy_info
+{
+    int num_dir;
+    int num_files;
+    int num_bytes;
+    int compress_mode; // COPY_COMPRESS or COPY_DECOMPRESS to run file data through the lz stage, 0 for a plain copy
+    lz_stats lz_stats;
+    copy_progress *progress; // NULL unless a progress bar is shown
+    // strategies for the destination filesystem, one per size class, looked up in the copy profile with the first file
+    int profile_loaded;
+    unsigned long long dest_dev;
+    int strategy[3];
+    int fallback[3];
+    int failed_loaded;
+    unsigned long long failed_dev; // source device the failed bits are for
+    unsigned failed; // strategies that did not work from failed_dev to dest_dev, one bit each
+} copy_info;
+
+#define COPY_COMPRESS 1
+#define COPY_DECOMPRESS 2
+
+// copies an already opened file through the lz stage, compressing or decompressing it depending on copy_info
+// closes both files and updates copy_info the same way filecopy does. size is the source size as stat saw it
+int filecopy_lz(const char *source, int input_fd, const char *dest, int dest_fd, uint64_t size, copy_info *copy_info)
+{
+    TRACE_SPAN("filecopy_lz");
+    lz_reader reader;
+    lz_writer writer;
+    int copy_ret = lz_reader_open(&reader, input_fd, source, copy_info->compress_mode == COPY_DECOMPRESS, &copy_info->lz_stats);
+    if (!copy_ret) { copy_ret = lz_writer_open(&writer, dest_fd, dest, copy_info->compress_mode == COPY_COMPRESS, size, &copy_info->lz_stats); }
+    else { memset(&writer, 0, sizeof(writer)); }
+    char buffer[65536];
+    int total_bytes = 0;
+    while (!copy_ret)
+    {
+        ssize_t read_ret = lz_read(&reader, buffer, sizeof(buffer));
+        if (read_ret < 0) { copy_ret = 1; break; }
+        if (!read_ret) break; // we have reached the end of the file
+        copy_ret = lz_write(&writer, buffer, read_ret);
+        total_bytes += read_ret;
+        progress_update(copy_info->progress, read_ret, 0);
+    }
+    if (lz_writer_close(&writer)) { copy_ret = 1; }
+    lz_reader_close(&reader);
+    if (!copy_ret) { log_at(LOG_FILES, "%s -> %s\n", source, dest); } // output when a successful copy occurs
+    if (close(input_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+        exit(1);
+    }
+    if (close(dest_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+        exit(1);
+    }
+    if (copy_ret) { return 1; }
+    copy_info->num_bytes += total_bytes;
+    copy_info->num_files++;
+    progress_update(copy_info->progress, 0, 1);
+    return 0;
+}
+
+// *** Copy strategies
+
+// the fastest way to copy a file depends on the filesystem and on the size of the file, so the first time a copy
+// writes to a filesystem every strategy is timed on a few sizes in the destination directory and the winner for
+// each size class is kept in ~/.myshell_copy_profile. a copy looks its destination up once and keeps the strategies
+// in its copy_info, so filecopy picks one per file without a lock or a system call
+#define COPY_RW_4K 0 // the read/write loop in filecopy
+#define COPY_RW_64K 1
+#define COPY_RW_1M 2
+#define COPY_FILE_RANGE 3
+#define COPY_REFLINK 4
+#define COPY_DIRECT 5
+#define COPY_NUM_STRATEGIES 6
+#define COPY_NUM_CLASSES 3
+#define COPY_MAX_PROFILES 64
+// first line of the profile file. version 2 dropped mmap, which raises SIGBUS when the source shrinks under it
+#define COPY_PROFILE_VERSION "myshell-copy-profile 2"
+
+const char *copy_strategy_names[COPY_NUM_STRATEGIES] = {"read/write 4k", "read/write 64k", "read/write 1m",
+                                                        "copy_file_range", "reflink", "O_DIRECT"};
+const char *copy_class_names[COPY_NUM_CLASSES] = {"small", "medium", "large"};
+const size_t copy_class_limits[COPY_NUM_CLASSES] = {256 * 1024, 16 * 1024 * 1024, SIZE_MAX};
+// calibration copies count files of size bytes for every class
+const size_t copy_class_sizes[COPY_NUM_CLASSES] = {16 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+const int copy_class_counts[COPY_NUM_CLASSES] = {32, 4, 1};
+
+typedef struct copy_profile
+{
+    unsigned long long dev;
+    unsigned long fs_type;
+    int strategy[COPY_NUM_CLASSES];
+    int fallback[COPY_NUM_CLASSES]; // the fastest strategy that also works when the source is on another filesystem
+    double rate[COPY_NUM_CLASSES]; // MB/s of the winner when it was measured
+} copy_profile;
+
+// calibration copies within one filesystem, but copy_file_range and reflink usually fail across two
+#define COPY_NEEDS_SAME_FS(strategy) ((strategy) == COPY_FILE_RANGE || (strategy) == COPY_REFLINK)
+
+// strategies that failed as unsupported for a source and destination device, so they are not tried on every file
+typedef struct copy_failure
+{
+    unsigned long long source_dev;
+    unsigned long long dest_dev;
+    unsigned failed; // one bit per strategy
+} copy_failure;
+
+copy_profile copy_profiles[COPY_MAX_PROFILES];
+int num_copy_profiles = -1; // -1 until the profile file has been read
+copy_failure copy_failures[COPY_MAX_PROFILES];
+int num_copy_failures;
+pthread_mutex_t copy_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// errors that mean the strategy does not work here rather than that the copy failed
+int copy_strategy_unsupported(int error)
+{
+    return error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == ENOTTY || error == ENOSYS ||
+           error == EBADF || error == ENODEV;
+}
+
+// copy input_fd to dest_fd with one strategy. size is what fstat said, only reflink relies on it since a clone
+// takes the whole file. returns the number of bytes copied, or -1 with errno set
+int64_t copy_with_strategy(int strategy, int input_fd, int dest_fd, uint64_t size)
+{
+    static const size_t buffer_sizes[] = {4096, 65536, 1048576};
+    int64_t total = 0;
+    if (strategy <= COPY_RW_1M)
+    {
+        char *buffer = malloc(buffer_sizes[strategy]);
+        if (buffer == NULL) { return -1; }
+        ssize_t read_ret;
+        while ((read_ret = read_all(input_fd, buffer, buffer_sizes[strategy])) > 0)
+        {
+            if (write_all(dest_fd, buffer, read_ret) < 0) break;
+            total += read_ret;
+        }
+        int saved_errno = errno;
+        free(buffer);
+        errno = saved_errno;
+        return read_ret == 0 ? total : -1;
+    }
+    if (strategy == COPY_FILE_RANGE)
+    {
+        while (1)
+        {
+            ssize_t copied = copy_file_range(input_fd, NULL, dest_fd, NULL, 1 << 30, 0);
+            if (copied < 0 && errno == EINTR) { continue; }
+            if (copied < 0) { return -1; }
+            if (copied == 0) { return total; }
+            total += copied;
+        }
+    }
+    if (strategy == COPY_REFLINK)
+    {
+        return ioctl(dest_fd, FICLONE, input_fd) < 0 ? -1 : (int64_t)size;
+    }
+    // O_DIRECT writes need an aligned buffer, and the tail that is not a whole block goes through the page cache
+    int flags = fcntl(dest_fd, F_GETFL);
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, 1048576)) { return -1; }
+    if (fcntl(dest_fd, F_SETFL, flags | O_DIRECT) < 0)
+    {
+        free(buffer);
+        return -1;
+    }
+    ssize_t read_ret;
+    while ((read_ret = read_all(input_fd, buffer, 1048576)) > 0)
+    {
+        if (read_ret % 4096) { fcntl(dest_fd, F_SETFL, flags); }
+        if (write_all(dest_fd, buffer, read_ret) < 0) break;
+        total += read_ret;
+    }
+    int saved_errno = errno;
+    fcntl(dest_fd, F_SETFL, flags);
+    free(buffer);
+    errno = saved_errno;
+    return read_ret == 0 ? total : -1;
+}
+
+char *join_path(const char *dir, const char *name);
+
+char *copy_profile_path()
+{
+    const char *home = getenv("HOME");
+    return home == NULL ? NULL : join_path(home, ".myshell_copy_profile");
+}
+
+void copy_profile_load()
+{
+    num_copy_profiles = 0;
+    char *path = copy_profile_path();
+    FILE *profile_file = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (profile_file == NULL) { return; }
+    char version[64];
+    if (fgets(version, sizeof(version), profile_file) == NULL || strcmp(version, COPY_PROFILE_VERSION "\n"))
+    {
+        fclose(profile_file); // an older profile, every filesystem is measured again
+        return;
+    }
+    copy_profile *profile = &copy_profiles[0];
+    while (num_copy_profiles < COPY_MAX_PROFILES &&
+           fscanf(profile_file, "%llu %lx %d %d %d %d %d %d %lf %lf %lf", &profile->dev, &profile->fs_type,
+                  &profile->strategy[0], &profile->strategy[1], &profile->strategy[2],
+                  &profile->fallback[0], &profile->fallback[1], &profile->fallback[2],
+                  &profile->rate[0], &profile->rate[1], &profile->rate[2]) == 11)
+    {
+        int valid = 1;
+        for (int i = 0; i < COPY_NUM_CLASSES; i++)
+        {
+            if (profile->strategy[i] < 0 || profile->strategy[i] >= COPY_NUM_STRATEGIES ||
+                profile->fallback[i] < 0 || profile->fallback[i] >= COPY_NUM_STRATEGIES || COPY_NEEDS_SAME_FS(profile->fallback[i]))
+            {
+                valid = 0;
+            }
+        }
+        if (valid) { profile = &copy_profiles[++num_copy_profiles]; }
+    }
+    fclose(profile_file);
+}
+
+void copy_profile_save()
+{
+    char *path = copy_profile_path();
+    FILE *profile_file = path ? fopen(path, "w") : NULL;
+    if (profile_file == NULL)
+    {
+        if (path != NULL) { fprintf(stderr, "copy: Unable to save copy profile %s: %s\n", path, strerror(errno)); }
+        free(path);
+        return;
+    }
+    fprintf(profile_file, COPY_PROFILE_VERSION "\n");
+    for (int i = 0; i < num_copy_profiles; i++)
+    {
+        copy_profile *profile = &copy_profiles[i];
+        fprintf(profile_file, "%llu %lx %d %d %d %d %d %d %.1f %.1f %.1f\n", profile->dev, profile->fs_type,
+                profile->strategy[0], profile->strategy[1], profile->strategy[2],
+                profile->fallback[0], profile->fallback[1], profile->fallback[2],
+                profile->rate[0], profile->rate[1], profile->rate[2]);
+    }
+    if (fclose(profile_file) == EOF) { fprintf(stderr, "copy: Unable to save copy profile %s: %s\n", path, strerror(errno)); }
+    free(path);
+}
+
+// time count copies of a size byte file with one strategy inside dir, synced to disk.
+// returns the rate in MB/s or 0 if the strategy does not work there
+double copy_calibrate(const char *dir, int strategy, size_t size, int count, const char *data)
+{
+    char *source = join_path(dir, ".myshell-calibrate-XXXXXX");
+    char *dest = join_path(dir, ".myshell-calibrate-XXXXXX");
+    if (source == NULL || dest == NULL)
+    {
+        free(source);
+        free(dest);
+        return 0;
+    }
+    int input_fd = mkstemp(source);
+    if (input_fd < 0)
+    {
+        free(source);
+        free(dest);
+        return 0;
+    }
+    unlink(source);
+    double rate = 0;
+    if (write_all(input_fd, data, size) == 0 && fdatasync(input_fd) == 0)
+    {
+        double start = monotonic_seconds();
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            strcpy(dest + strlen(dest) - 6, "XXXXXX");
+            int dest_fd = mkstemp(dest);
+            if (dest_fd < 0) break;
+            unlink(dest);
+            lseek(input_fd, 0, SEEK_SET);
+            int copy_ret = copy_with_strategy(strategy, input_fd, dest_fd, size) == (int64_t)size ? 0 : -1;
+            if (!copy_ret) { copy_ret = fdatasync(dest_fd); }
+            close(dest_fd);
+            if (copy_ret) break;
+        }
+        double elapsed = monotonic_seconds() - start;
+        if (i == count) { rate = (double)size * count / (elapsed > 0 ? elapsed : 1e-9) / 1048576.0; }
+    }
+    close(input_fd);
+    free(source);
+    free(dest);
+    return rate;
+}
+
+// measure every strategy for every size class on the filesystem dest lives on
+void copy_calibrate_all(const char *dest, copy_profile *profile)
+{
+    char *dir = strdup(dest);
+    char *slash = dir ? strrchr(dir, '/') : NULL;
+    if (dir == NULL) { return; }
+    if (slash == NULL) { strcpy(dir, "."); }
+    else if (slash == dir) { dir[1] = '\0'; }
+    else { *slash = '\0'; }
+    char *data = malloc(copy_class_sizes[COPY_NUM_CLASSES - 1]);
+    if (data != NULL)
+    {
+        uint64_t state = 0x9e3779b97f4a7c15ull; // xorshift, so the filesystem can not compress or dedupe the data
+        for (size_t i = 0; i < copy_class_sizes[COPY_NUM_CLASSES - 1]; i += 8)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            memcpy(data + i, &state, 8);
+        }
+        log_at(LOG_SUMMARY, "copy: calibrating copy strategies for %s, this writes about 90 MB once per filesystem\n", dir);
+        log_flush(); // say so before the wait rather than after
+        for (int class = 0; class < COPY_NUM_CLASSES; class++)
+        {
+            double fallback_rate = 0;
+            for (int strategy = 0; strategy < COPY_NUM_STRATEGIES; strategy++)
+            {
+                double rate = copy_calibrate(dir, strategy, copy_class_sizes[class], copy_class_counts[class], data);
+                if (rate > profile->rate[class])
+                {
+                    profile->rate[class] = rate;
+                    profile->strategy[class] = strategy;
+                }
+                if (!COPY_NEEDS_SAME_FS(strategy) && rate > fallback_rate)
+                {
+                    fallback_rate = rate;
+                    profile->fallback[class] = strategy;
+                }
+            }
+            log_at(LOG_SUMMARY, "copy: %s files: %s at %.1f MB/s, %s from other filesystems\n", copy_class_names[class],
+                    copy_strategy_names[profile->strategy[class]], profile->rate[class],
+                    copy_strategy_names[profile->fallback[class]]);
+        }
+        free(data);
+    }
+    free(dir);
+}
+
+// the strategies that have failed copying from source_dev to dest_dev. call with copy_profile_mutex held
+copy_failure *copy_failure_for(unsigned long long source_dev, unsigned long long dest_dev, int add)
+{
+    for (int i = 0; i < num_copy_failures; i++)
+    {
+        if (copy_failures[i].source_dev == source_dev && copy_failures[i].dest_dev == dest_dev) { return &copy_failures[i]; }
+    }
+    if (!add || num_copy_failures == COPY_MAX_PROFILES) { return NULL; }
+    copy_failure *failure = &copy_failures[num_copy_failures++];
+    failure->source_dev = source_dev;
+    failure->dest_dev = dest_dev;
+    failure->failed = 0;
+    return failure;
+}
+
+// call with copy_profile_mutex held
+copy_profile *copy_profile_find(unsigned long long dev, unsigned long fs_type)
+{
+    if (num_copy_profiles < 0) { copy_profile_load(); }
+    for (int i = 0; i < num_copy_profiles; i++)
+    {
+        if (copy_profiles[i].dev == dev && copy_profiles[i].fs_type == fs_type) { return &copy_profiles[i]; }
+    }
+    return NULL;
+}
+
+int copy_calibrating; // set while one copy calibrates copy_calibrating_dev, the others use the read loop meanwhile
+unsigned long long copy_calibrating_dev;
+
+// looks up the strategies for the filesystem dest is on once per job, calibrating it if it has never been seen.
+// the calibration runs without the lock so other copies are not held up by it
+void copy_profile_resolve(copy_info *copy_info, int dest_fd, const char *dest)
+{
+    for (int class = 0; class < COPY_NUM_CLASSES; class++)
+    {
+        copy_info->strategy[class] = COPY_RW_4K;
+        copy_info->fallback[class] = COPY_RW_4K;
+    }
+    struct stat stat_buffer;
+    struct statfs statfs_buffer;
+    if (fstat(dest_fd, &stat_buffer) == -1 || fstatfs(dest_fd, &statfs_buffer) == -1) { return; }
+    copy_info->dest_dev = stat_buffer.st_dev;
+    pthread_mutex_lock(&copy_profile_mutex);
+    copy_profile *found = copy_profile_find(stat_buffer.st_dev, statfs_buffer.f_type);
+    copy_profile profile;
+    if (found != NULL) { profile = *found; }
+    else if (copy_calibrating && copy_calibrating_dev == stat_buffer.st_dev)
+    {
+        pthread_mutex_unlock(&copy_profile_mutex);
+        return; // look again with the next file
+    }
+    else
+    {
+        copy_calibrating = 1;
+        copy_calibrating_dev = stat_buffer.st_dev;
+    }
+    pthread_mutex_unlock(&copy_profile_mutex);
+    if (found == NULL)
+    {
+        memset(&profile, 0, sizeof(profile));
+        profile.dev = stat_buffer.st_dev;
+        profile.fs_type = statfs_buffer.f_type;
+        copy_calibrate_all(dest, &profile);
+        pthread_mutex_lock(&copy_profile_mutex);
+        found = copy_profile_find(stat_buffer.st_dev, statfs_buffer.f_type);
+        if (found != NULL) { profile = *found; } // another copy measured it at the same time, keep theirs
+        else if (num_copy_profiles < COPY_MAX_PROFILES)
+        {
+            copy_profiles[num_copy_profiles++] = profile;
+            copy_profile_save();
+        }
+        copy_calibrating = 0;
+        pthread_mutex_unlock(&copy_profile_mutex);
+    }
+    copy_info->profile_loaded = 1;
+    memcpy(copy_info->strategy, profile.strategy, sizeof(copy_info->strategy));
+    memcpy(copy_info->fallback, profile.fallback, sizeof(copy_info->fallback));
+}
+
+// the strategy to copy a file of size bytes from source_dev. strategies that already failed for this pair of devices
+// are passed over for the profile's fallback. the shared tables are only locked when the source device changes
+int copy_strategy_for(copy_info *copy_info, unsigned long long source_dev, int dest_fd, const char *dest, uint64_t size)
+{
+    if (!copy_info->profile_loaded) { copy_profile_resolve(copy_info, dest_fd, dest); }
+    if (!copy_info->failed_loaded || copy_info->failed_dev != source_dev)
+    {
+        pthread_mutex_lock(&copy_profile_mutex);
+        copy_failure *failure = copy_failure_for(source_dev, copy_info->dest_dev, 0);
+        copy_info->failed = failure ? failure->failed : 0;
+        pthread_mutex_unlock(&copy_profile_mutex);
+        copy_info->failed_loaded = 1;
+        copy_info->failed_dev = source_dev;
+    }
+    int class = 0;
+    while (size >= copy_class_limits[class]) { class++; }
+    int strategy = copy_info->strategy[class];
+    if (copy_info->failed & (1u << strategy)) { strategy = copy_info->fallback[class]; }
+    if (copy_info->failed & (1u << strategy)) { strategy = COPY_RW_4K; }
+    return strategy;
+}
+
+// remember that strategy does not work from source_dev to the destination, for this job and later ones
+void copy_strategy_failed(copy_info *copy_info, unsigned long long source_dev, int strategy)
+{
+    copy_info->failed |= 1u << strategy;
+    pthread_mutex_lock(&copy_profile_mutex);
+    copy_failure *failure = copy_failure_for(source_dev, copy_info->dest_dev, 1);
+    if (failure != NULL) { failure->failed |= 1u << strategy; }
+    pthread_mutex_unlock(&copy_profile_mutex);
+}
+
+// copy --profile shows the table, copy --profile reset forgets it so every filesystem is measured again
+void copy_profile_command(int reset)
+{
+    pthread_mutex_lock(&copy_profile_mutex);
+    if (reset)
+    {
+        num_copy_profiles = 0;
+        num_copy_failures = 0;
+        char *path = copy_profile_path();
+        if (path != NULL && unlink(path) < 0 && errno != ENOENT)
+        {
+            fprintf(stderr, "copy: Unable to remove copy profile %s: %s\n", path, strerror(errno));
+        }
+        free(path);
+        printf("copy: profile reset\n");
+    }
+    else
+    {
+        if (num_copy_profiles < 0) { copy_profile_load(); }
+        if (!num_copy_profiles) { printf("copy: no filesystems have been profiled\n"); }
+        for (int i = 0; i < num_copy_profiles; i++)
+        {
+            copy_profile *profile = &copy_profiles[i];
+            printf("copy: device %u:%u (filesystem 0x%lx):", major(profile->dev), minor(profile->dev), profile->fs_type);
+            for (int class = 0; class < COPY_NUM_CLASSES; class++)
+            {
+                printf("%s %s %s %.1f MB/s", class ? "," : "", copy_class_names[class],
+                        copy_strategy_names[profile->strategy[class]], profile->rate[class]);
+                if (profile->fallback[class] != profile->strategy[class])
+                {
+                    printf(" (%s from other filesystems)", copy_strategy_names[profile->fallback[class]]);
+                }
+            }
+            printf("\n");
+        }
+    }
+    pthread_mutex_unlock(&copy_profile_mutex);
+}
+
+// copies an already opened file with the strategy chosen for it. returns 0 or 1 like filecopy after closing both
+// files, or -1 with both files rewound if the strategy does not work for this pair of files
+int filecopy_strategy(const char *source, int input_fd, const char *dest, int dest_fd, uint64_t size, int strategy,
+                      copy_info *copy_info)
+{
+    int64_t copy_ret = copy_with_strategy(strategy, input_fd, dest_fd, size);
+    if (copy_ret < 0 && copy_strategy_unsupported(errno))
+    {
+        if (lseek(input_fd, 0, SEEK_SET) == 0 && lseek(dest_fd, 0, SEEK_SET) == 0 && ftruncate(dest_fd, 0) == 0) { return -1; }
+    }
+    if (copy_ret < 0) { fprintf(stderr, "copy: Unable to copy file %s to %s: %s\n", source, dest, strerror(errno)); }
+    else { log_at(LOG_FILES, "%s -> %s\n", source, dest); } // output when a successful copy occurs
+    if (close(input_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+        exit(1);
+    }
+    if (close(dest_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+        exit(1);
+    }
+    if (copy_ret < 0) { return 1; }
+    copy_info->num_bytes += copy_ret;
+    copy_info->num_files++;
+    progress_update(copy_info->progress, copy_ret, 1);
+    return 0;
+}
+
+// arguments are the source file path and the destination file path, and copies a single file,
+// also updates copy_info
+// *** whenever we get an error with a systemcall, we do not continue but attempt to close as many files and free as much allocated memory as possible
+// if these actions also have an error (like we cant close a file), something is seriously wrong and we exit
+// this is why there is nested error cases for the system calls 
+int filecopy(const char *source, const char *dest, copy_info *copy_info)
+{
+    TRACE_SPAN("filecopy");
+    // open file to copy
+    int input_fd = open(source, O_RDONLY, 0);
+    if ( input_fd < 0 ) {
+        fprintf(stderr, "copy: Unable to open file %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    // open file destination and copy permissions
+    struct stat stat_buffer;
+    int stat_err = stat(source, &stat_buffer);
+    if ( stat_err == -1 ) {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source, strerror(errno));
+        int close_err = close(input_fd);
+        if ( close_err < 0 ) { // something seriously wrong happened
+            fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+            exit(1);
+        }
+	    return 1;
+    }
+    // create destination file
+    int dest_fd = open(dest, O_CREAT|O_WRONLY|O_TRUNC, stat_buffer.st_mode);
+    if ( dest_fd < 0 ) {
+        fprintf(stderr, "copy: Unable to create file %s: %s\n", dest, strerror(errno));
+	    int close_err = close(input_fd);
+        if ( close_err < 0 ) { // something seriously wrong happened
+            fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+            exit(1);
+        }
+	    return 1;
+    }
+
+    if (copy_info->compress_mode) // compressed copies go through the lz stage instead
+    {
+        return filecopy_lz(source, input_fd, dest, dest_fd, stat_buffer.st_size, copy_info);
+    }
+    // the fastest way for this size and filesystem, or the next best once a strategy turns out not to work here.
+    // files that are not regular or claim to be empty (like those in /proc) always go through the read loop
+    int strategy;
+    unsigned tried = 0;
+    while (S_ISREG(stat_buffer.st_mode) && stat_buffer.st_size > 0 &&
+           (strategy = copy_strategy_for(copy_info, stat_buffer.st_dev, dest_fd, dest, stat_buffer.st_size)) != COPY_RW_4K &&
+           !(tried & (1u << strategy)))
+    {
+        int strategy_ret = filecopy_strategy(source, input_fd, dest, dest_fd, stat_buffer.st_size, strategy, copy_info);
+        if (strategy_ret >= 0) { return strategy_ret; }
+        tried |= 1u << strategy;
+        copy_strategy_failed(copy_info, stat_buffer.st_dev, strategy);
+    }
+    // otherwise fall back to the plain loop below
+
+    char buffer[4096]; // read in source file in 4kb chunks
+    // ints to store return values from the read and write system calls
+    int read_ret;
+    int write_ret;
+    int total_bytes_written = 0;
+    while (1)
+    {
+        // attempt to read in a chunk from the source file
+        // 4 cases: read_ret = 4096, read_ret < 4096, read_ret = 0, read_ret is less than 1
+        read_ret = read(input_fd, buffer, 4096);
+        if ( read_ret < 0 ) {
+            if (errno == EINTR) { continue; } // if we encounter an interrupt error, go back to the start of the loop and try to read again
+            // if we get a fatal error, attempt to close the files and return
+            fprintf(stderr, "copy: Unable to read from file %s: %s\n", source, strerror(errno));
+            int close_err = close(input_fd);
+            if ( close_err < 0 ) {
+                fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+                exit(1);
+            }
+            close_err = close(dest_fd);
+            if ( close_err < 0 ) {
+                fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+                exit(1);
+            }
+            return 1;
+        }
+        if (!read_ret) break; // we have reached the end of the file
+        
+        // try to write to destination file
+        write_ret = write(dest_fd, buffer, read_ret);
+        if ( write_ret < 0 ) {
+            if (errno == EINTR) {} // if we get interrupted while trying to write, we try to finish the write in the code block below
+            else
+            {
+                // if we get a fatal error, attempt to close the files and return
+                fprintf(stderr, "copy: Unable to write to file %s: %s\n", dest, strerror(errno));
+                int close_err = close(input_fd);
+                if ( close_err < 0 ) {
+                    fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+                    exit(1);
+                }
+                close_err = close(dest_fd);
+                if ( close_err < 0 ) {
+                    fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+                    exit(1);
+                }
+                return 1;
+            }
+        }
+        // if we are unable to write all the bytes, keep trying until we get a hard error
+        int current_bytes_written = write_ret;
+        if (current_bytes_written < 0) { current_bytes_written = 0; } // special case for EINTR: 0 bytes were written in that case
+        while (current_bytes_written < read_ret)
+        {
+            write_ret = write(dest_fd, buffer, read_ret);
+            if ( write_ret < 0 ) {
+                if (errno == EINTR) { continue; } // if we encounter another EINTR, try again
+                else // if we encounter a fatal error 
+                {
+                    // if we get a fatal error, attempt to close the files and return
+                    fprintf(stderr, "copy: Unable to write to file %s: %s\n", source, strerror(errno));
+                    int close_err = close(input_fd);
+                    if ( close_err < 0 ) {
+                        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+                        exit(1);
+                    }
+                    close_err = close(dest_fd);
+                    if ( close_err < 0 ) {
+                        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+                        exit(1);
+                    }
+                    return 1;
+                }
+            }
+            current_bytes_written += write_ret;
+        }
+        total_bytes_written += current_bytes_written;
+        progress_update(copy_info->progress, current_bytes_written, 0);
+    }
+
+    // output when a successful copy occurs
+    log_at(LOG_FILES, "%s -> %s\n", source, dest);
+
+    // close source file
+    int close_err = close(input_fd); // if we can't close a file something is seriously wrong
+    if ( close_err < 0 ) {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
+	    close_err = close(dest_fd);
+        if ( close_err < 0 ) {
+            fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+            exit(1);
+        }
+        exit(1);
+    }
+
+    // close destination file
+    close_err = close(dest_fd);
+    if ( close_err < 0 ) {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+	    exit(1);
+    }
+    // update info about files copied
+    copy_info->num_bytes += total_bytes_written;
+    copy_info->num_files++;
+    progress_update(copy_info->progress, 0, 1);
+    return 0;
+}
+
+// returns a newly allocated "dir/name", or a copy of dir when name is empty
+// used to build source and destination paths while walking a tree
+char *join_path(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL) { return NULL; }
+    if (name[0]) { sprintf(path, "%s/%s", dir, name); }
+    else { strcpy(path, dir); }
+    return path;
+}
+
+// callback used by walk_directory for the root directory and every entry beneath it
+// path is the full source path and relpath is the path relative to the root ("" for the root itself)
+// d_type is the dirent type (4 for directories, 8 for regular files), returning nonzero stops the walk
+// except for WALK_SKIP, which a directory visit can return to leave out everything beneath that directory
+#define WALK_SKIP 2
+typedef int (*walk_visitor)(const char *path, const char *relpath, unsigned char d_type, void *arg);
+
+// takes in a directory path, calls visit on it and then recursively calls itself for every directory in that directory
+// every other entry in the directory is handed to visit as well, cmd is used to prefix error messages
+// same as filecopy above, if we get a system call error, attempt to free as many resources and return
+// if there is an error freeing resources, something is seriously wrong and we quit
+int walk_directory(const char *cmd, const char *dirname, const char *relpath, walk_visitor visit, void *arg)
+{
+    TRACE_SPAN("walk_directory");
+    // attempt to open directory
+    DIR *current_dir = opendir(dirname);
+    if ( current_dir == 0 ) {
+        fprintf(stderr, "%s: Unable to open directory %s: %s\n", cmd, dirname, strerror(errno));
+        return 1;
+    }
+    int visit_ret = visit(dirname, relpath, 4, arg);
+    if (visit_ret)
+    {
+        int close_err = closedir(current_dir);
+        if ( close_err == -1 ) {
+            fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+            exit(1);
+        }
+        return visit_ret == WALK_SKIP ? 0 : 1;
+    }
+    errno = 0; // set errno to be zero because readdir returns zero both if it errors out or reaches the end of the directory. 
+    // readdir fails is errno is set to a nonzero value after the call
+    struct dirent *dir_info = readdir(current_dir);
+    if ( errno ) {
+        fprintf(stderr, "%s: Unable to read directory %s: %s\n", cmd, dirname, strerror(errno));
+        int close_err = closedir(current_dir);
+        if ( close_err == -1 ) {
+            fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+            exit(1);
+        }
+        return 1;
+    }
+    while (dir_info) // loop while dir_info is not null and we haven't reached the last file entry
+    {
+        if (strcmp(dir_info->d_name, ".") && strcmp(dir_info->d_name, "..")) // skip the . and .. files
+        {
+            // create the current path and the path relative to the root
+            char *current_path = join_path(dirname, dir_info->d_name);
+            char *current_rel = relpath[0] ? join_path(relpath, dir_info->d_name) : strdup(dir_info->d_name);
+            if (current_path == NULL || current_rel == NULL)
+            {
+                fprintf(stderr, "%s: Unable to allocate memory: exiting program\n", cmd);
+                if (current_path != NULL) {free(current_path);}
+                if (current_rel != NULL) {free(current_rel);}
+                int close_err = closedir(current_dir);
+                if ( close_err == -1 ) {
+                    fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+                    exit(1);
+                }
+                return 1;
+            }
+            if (dir_info->d_type == 4) // if the file in the directory is another directory, recursively walk from there
+            {
+                visit_ret = walk_directory(cmd, current_path, current_rel, visit, arg);
+            }
+            else // otherwise let the visitor decide what to do with it
+            {
+                visit_ret = visit(current_path, current_rel, dir_info->d_type, arg);
+            }
+            free(current_path);
+            free(current_rel);
+            if (visit_ret)
+            {
+                int close_err = closedir(current_dir);
+                if ( close_err == -1 ) {
+                    fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+                    exit(1);
+                }
+                return 1;
+            }
+        }
+        // try to see if the dir contains more files
+        errno = 0;
+        dir_info = readdir(current_dir); 
+        if ( errno ) {
+            fprintf(stderr, "%s: Unable to read from directory %s: %s\n", cmd, dirname, strerror(errno));
+            int close_err = closedir(current_dir);
+            if ( close_err == -1 ) {
+                fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+                exit(1);
+            }
+            return 1;
+        }
+    }
+    // close the directory
+    int close_err = closedir(current_dir);
+    if ( close_err == -1 ) {
+        fprintf(stderr, "%s: Unable to close directory %s: %s\n", cmd, dirname, strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
+
+// destination and counters handed to copy_visitor through walk_directory
+typedef struct copy_walk
+{
+    const char *destname;
+    copy_info *copy_info;
+} copy_walk;
+
+// creates the matching directory or copies the file for one entry of the source tree
+int copy_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    copy_walk *walk = arg;
+    char *copy_to = join_path(walk->destname, relpath);
+    if (copy_to == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        return 1;
+    }
+    int copy_ret = 0;
+    if (d_type == 4) // directories are created with the same permissions
+    {
+        struct stat stat_buffer;
+        int stat_err = stat(path, &stat_buffer);
+        if ( stat_err == -1 ) {
+            fprintf(stderr, "copy: Unable to stat directory %s: %s\n", path, strerror(errno));
+            copy_ret = 1;
+        }
+        else if (mkdir(copy_to, stat_buffer.st_mode) < 0)
+        {
+            fprintf(stderr, "copy: Unable to create directory %s: %s\n", copy_to, strerror(errno));
+            copy_ret = 1;
+        }
+        else
+        {
+            // display successful copy
+            log_at(LOG_FILES, "%s -> %s\n", path, copy_to);
+            walk->copy_info->num_dir++;
+        }
+    }
+    else if (d_type == 8) // else if its a regular file, preform filecopy on it
+    {
+        copy_ret = filecopy(path, copy_to, walk->copy_info);
+    }
+    else // other file types should exit
+    {
+        fprintf(stderr, "copy: Unable to copy file %s: file is not a regular file or directory\n", path);
+        copy_ret = 1;
+    }
+    free(copy_to);
+    return copy_ret;
+}
+
+// takes in a directory path and copies it and everything beneath it to destname
+// the directory traversal itself is done by walk_directory, copy_visitor does the copying
+int recursive_directory_copy(const char *dirname, const char *destname, copy_info *copy_info)
+{
+    TRACE_SPAN("recursive_directory_copy");
+    copy_walk walk = {destname, copy_info};
+    return walk_directory("copy", dirname, "", copy_visitor, &walk);
+}
+int treecopy(char *source_file, char *dest_file, int compress_mode, copy_progress *progress)
+{
+    copy_info copy_info = {0, 0, 0, compress_mode}; // struct used to store info on how much data was copied
+    copy_info.progress = progress;
+
+    // read input to see if its a dir or a file or other
+    struct stat stat_buffer;
+    int stat_err = stat(source_file, &stat_buffer);
+    if ( stat_err == -1 ) {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source_file, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(stat_buffer.st_mode)) // if its only a file just copy it
+    {
+        if (filecopy(source_file, dest_file, &copy_info)) {return 1;}
+    }
+    else //otherwise its a directory
+    {
+        if (source_file[strlen(source_file) - 1] == '/') // remove trailing / if it exists
+        {
+            char *dir_source = malloc(strlen(source_file) + 1); // allocate memory for string with trailing / removed
+            if (dir_source == NULL)
+            {
+                fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+                exit(1);
+            }
+            strcpy(dir_source, source_file);
+            dir_source[strlen(source_file) - 1] = '\0'; // remove /
+            int copy_ret = recursive_directory_copy(dir_source, dest_file, &copy_info); // begin recursively copying the directory with removing trailing /
+            if (dir_source != NULL) {free(dir_source);}
+            if (copy_ret){return 1;} // recursivly bubble up error returns
+        }
+        else
+        {
+            int copy_ret = recursive_directory_copy(source_file, dest_file, &copy_info); // begin recursively copying the directory without having to change argv
+            if (copy_ret){return 1;}
+        } 
+    }
+    progress_finish(progress);
+    log_at(LOG_SUMMARY, "copy: copied %d directories, %d files, and %d bytes from %s to %s\n",
+            copy_info.num_dir, copy_info.num_files, copy_info.num_bytes, source_file, dest_file);
+    lz_report(compress_mode == COPY_COMPRESS ? "compressed" : "decompressed", &copy_info.lz_stats);
+    return 0;
+}
+
+// *** End Code taken from treecopy.c 
+
+// *** Batched copy
+
+// copy src1 src2 ... dstdir copies every source into dstdir under its own name as one job with one summary.
+// with --parallel the sources are shared out between worker threads that each count into their own copy_info
+#define COPY_MAX_THREADS 16
+
+typedef struct copy_batch
+{
+    char **sources;
+    int num_sources;
+    const char *dest_dir;
+    int next_source; // taken with an atomic add by the workers
+    int failed;
+    copy_info totals;
+    pthread_mutex_t mutex; // protects totals and failed
+} copy_batch;
+
+// copies one source to dest_dir/its name
+int copy_batch_source(const char *source, const char *dest_dir, copy_info *copy_info)
+{
+    char *root = strdup(source);
+    if (root == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') { root[--len] = '\0'; } // remove trailing / if it exists
+    const char *slash = strrchr(root, '/');
+    char *dest = join_path(dest_dir, slash ? slash + 1 : root);
+    if (dest == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    int copy_ret;
+    struct stat stat_buffer;
+    if (stat(root, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", root, strerror(errno));
+        copy_ret = 1;
+    }
+    else if (S_ISDIR(stat_buffer.st_mode)) { copy_ret = recursive_directory_copy(root, dest, copy_info); }
+    else { copy_ret = filecopy(root, dest, copy_info); }
+    free(dest);
+    free(root);
+    return copy_ret;
+}
+
+void *copy_batch_worker_main(void *arg)
+{
+    copy_batch *batch = arg;
+    copy_info copy_info = batch->totals; // same compress_mode and progress, counts start at 0
+    int failed = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next_source, 1, __ATOMIC_RELAXED)) < batch->num_sources)
+    {
+        if (copy_batch_source(batch->sources[i], batch->dest_dir, &copy_info)) { failed = 1; }
+    }
+    pthread_mutex_lock(&batch->mutex);
+    batch->totals.num_dir += copy_info.num_dir;
+    batch->totals.num_files += copy_info.num_files;
+    batch->totals.num_bytes += copy_info.num_bytes;
+    batch->totals.lz_stats.raw_bytes += copy_info.lz_stats.raw_bytes;
+    batch->totals.lz_stats.stored_bytes += copy_info.lz_stats.stored_bytes;
+    batch->totals.lz_stats.blocks += copy_info.lz_stats.blocks;
+    batch->totals.lz_stats.raw_blocks += copy_info.lz_stats.raw_blocks;
+    batch->totals.lz_stats.seconds += copy_info.lz_stats.seconds;
+    batch->failed |= failed;
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+// copies all sources into dest_dir, creating it if needed. a source that fails does not stop the others
+int treecopy_batch(char **sources, int num_sources, const char *dest_dir, int compress_mode, int parallel,
+                   copy_progress *progress)
+{
+    TRACE_SPAN("treecopy_batch");
+    struct stat stat_buffer;
+    if (stat(dest_dir, &stat_buffer) == -1)
+    {
+        if (errno != ENOENT || mkdir(dest_dir, 0777) < 0)
+        {
+            fprintf(stderr, "copy: Unable to create directory %s: %s\n", dest_dir, strerror(errno));
+            return 1;
+        }
+    }
+    else if (!S_ISDIR(stat_buffer.st_mode))
+    {
+        fprintf(stderr, "copy: Unable to copy %d sources to %s: %s\n", num_sources, dest_dir, strerror(ENOTDIR));
+        return 1;
+    }
+    copy_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.sources = sources;
+    batch.num_sources = num_sources;
+    batch.dest_dir = dest_dir;
+    batch.totals.compress_mode = compress_mode;
+    batch.totals.progress = progress;
+    pthread_mutex_init(&batch.mutex, NULL);
+    int num_threads = 1;
+    if (parallel)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus < 1 ? 1 : (cpus > COPY_MAX_THREADS ? COPY_MAX_THREADS : cpus);
+        if (num_threads > num_sources) { num_threads = num_sources; }
+    }
+    pthread_t threads[COPY_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < num_threads; i++)
+    {
+        if (pthread_create(&threads[started], NULL, copy_batch_worker_main, &batch) == 0) { started++; }
+    }
+    copy_batch_worker_main(&batch); // this thread works too
+    for (int i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+    pthread_mutex_destroy(&batch.mutex);
+
+    progress_finish(progress);
+    char from[32];
+    snprintf(from, sizeof(from), "%d sources", num_sources);
+    log_at(LOG_SUMMARY, "copy: copied %d directories, %d files, and %d bytes from %s to %s\n",
+            batch.totals.num_dir, batch.totals.num_files, batch.totals.num_bytes,
+            num_sources > 1 ? from : batch.sources[0], dest_dir);
+    lz_report(compress_mode == COPY_COMPRESS ? "compressed" : "decompressed", &batch.totals.lz_stats);
+    return batch.failed;
+}
+
+// *** Physically ordered copy
+
+// copy --ordered creates the directories while walking the source like a normal copy but holds the files back,
+// then copies them sorted by where their data starts on the device so the reads sweep across it instead of
+// seeking back and forth in readdir order. the position comes from FIEMAP, or the inode number where the
+// filesystem does not support it, which tends to follow allocation order
+typedef struct ordered_file
+{
+    char *path;
+    char *dest;
+    uint64_t physical; // byte offset of the first extent, or the inode number
+    uint64_t inode;
+    uint64_t size;
+} ordered_file;
+
+typedef struct ordered_copy
+{
+    copy_walk walk;
+    ordered_file *files;
+    int num_files;
+    int capacity;
+    int use_fiemap; // cleared after the first file the filesystem cannot map, then every file is sorted by inode
+} ordered_copy;
+
+// where the data of a file starts on disk. returns 0 and fills in physical, or -1 if it can not be mapped
+int file_first_extent(const char *path, uint64_t *physical)
+{
+    int input_fd = open(path, O_RDONLY, 0);
+    if (input_fd < 0) { return -1; }
+    struct
+    {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_flags = FIEMAP_FLAG_SYNC; // flush delayed allocation so the extent has a real location
+    request.map.fm_extent_count = 1;
+    int ioctl_ret = ioctl(input_fd, FS_IOC_FIEMAP, &request.map);
+    close(input_fd);
+    if (ioctl_ret < 0) { return -1; }
+    if (request.map.fm_mapped_extents && (request.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN)) { return -1; }
+    *physical = request.map.fm_mapped_extents ? request.extent.fe_physical : 0; // empty and inline files have none
+    return 0;
+}
+
+int ordered_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    ordered_copy *job = arg;
+    if (d_type != 8) { return copy_visitor(path, relpath, d_type, &job->walk); } // directories are made right away
+    struct stat stat_buffer;
+    if (stat(path, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (job->num_files == job->capacity)
+    {
+        job->capacity = job->capacity ? job->capacity * 2 : 256;
+        job->files = realloc(job->files, job->capacity * sizeof(ordered_file));
+        if (job->files == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+    }
+    ordered_file *file = &job->files[job->num_files];
+    file->path = strdup(path);
+    file->dest = join_path(job->walk.destname, relpath);
+    if (file->path == NULL || file->dest == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    file->size = stat_buffer.st_size;
+    file->inode = stat_buffer.st_ino;
+    file->physical = stat_buffer.st_ino;
+    if (job->use_fiemap && file_first_extent(path, &file->physical) < 0)
+    {
+        // offsets and inode numbers can not be sorted together, so the files so far go back to inode order too
+        job->use_fiemap = 0;
+        for (int i = 0; i < job->num_files; i++) { job->files[i].physical = job->files[i].inode; }
+        file->physical = stat_buffer.st_ino;
+    }
+    job->num_files++;
+    return 0;
+}
+
+int ordered_compare(const void *a, const void *b)
+{
+    const ordered_file *x = a;
+    const ordered_file *y = b;
+    return x->physical < y->physical ? -1 : (x->physical > y->physical ? 1 : 0);
+}
+
+// total distance the head would move reading the files in their current order
+uint64_t ordered_seek_distance(ordered_file *files, int num_files)
+{
+    uint64_t distance = 0;
+    uint64_t position = UINT64_MAX; // count from the first read, not the start of the device
+    for (int i = 0; i < num_files; i++)
+    {
+        if (!files[i].size) { continue; } // nothing is read from empty files
+        if (position == UINT64_MAX) { position = files[i].physical; }
+        distance += files[i].physical > position ? files[i].physical - position : position - files[i].physical;
+        position = files[i].physical + files[i].size;
+    }
+    return distance;
+}
+
+int ordered_treecopy(char *source_file, char *dest_file, int compress_mode)
+{
+    copy_info copy_info = {0, 0, 0, compress_mode};
+    ordered_copy job;
+    memset(&job, 0, sizeof(job));
+    job.walk.destname = dest_file;
+    job.walk.copy_info = &copy_info;
+    job.use_fiemap = 1;
+    struct stat stat_buffer;
+    if (stat(source_file, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source_file, strerror(errno));
+        return 1;
+    }
+    if (!S_ISDIR(stat_buffer.st_mode)) { return treecopy(source_file, dest_file, compress_mode, NULL); } // nothing to reorder
+    char *dir_source = strdup(source_file);
+    size_t len = strlen(dir_source);
+    if (len > 1 && dir_source[len - 1] == '/') { dir_source[len - 1] = '\0'; } // remove trailing / if it exists
+    int copy_ret = walk_directory("copy", dir_source, "", ordered_visitor, &job);
+    free(dir_source);
+
+    uint64_t walk_distance = ordered_seek_distance(job.files, job.num_files);
+    qsort(job.files, job.num_files, sizeof(ordered_file), ordered_compare);
+    uint64_t sorted_distance = ordered_seek_distance(job.files, job.num_files);
+    double start = monotonic_seconds();
+    for (int i = 0; i < job.num_files && !copy_ret; i++)
+    {
+        copy_ret = filecopy(job.files[i].path, job.files[i].dest, &copy_info);
+    }
+    double elapsed = monotonic_seconds() - start;
+    for (int i = 0; i < job.num_files; i++)
+    {
+        free(job.files[i].path);
+        free(job.files[i].dest);
+    }
+    free(job.files);
+    if (copy_ret) { return 1; }
+    log_at(LOG_SUMMARY, "copy: copied %d directories, %d files, and %d bytes from %s to %s\n",
+            copy_info.num_dir, copy_info.num_files, copy_info.num_bytes, source_file, dest_file);
+    if (job.use_fiemap)
+    {
+        log_at(LOG_SUMMARY, "copy: physical order cut the seek distance from %.1f MB to %.1f MB, copied at %.1f MB/s\n",
+                walk_distance / 1048576.0, sorted_distance / 1048576.0, elapsed > 0 ? copy_info.num_bytes / elapsed / 1048576.0 : 0);
+    }
+    else
+    {
+        log_at(LOG_SUMMARY, "copy: not every file in %s could be mapped with FIEMAP, copied in inode order at %.1f MB/s\n",
+                source_file, elapsed > 0 ? copy_info.num_bytes / elapsed / 1048576.0 : 0);
+    }
+    lz_report(compress_mode == COPY_COMPRESS ? "compressed" : "decompressed", &copy_info.lz_stats);
+    return 0;
+}
+
+// a pack holds a whole tree in one file so copying many small files becomes a single sequential write
+// layout: pak_header, num_entries pak_entry records, the name table padded to 8 bytes, then the file data back to back
+// each entry records the absolute 64 bit offset of its data so a packed file can be mmaped and any entry read directly,
+// and since the data is stored in entry order a pack can also be written to or read from a pipe without seeking
+#define PAK_MAGIC "MYSHPAK1"
+#define PAK_TYPE_DIR 4
+#define PAK_TYPE_FILE 8
+
+typedef struct pak_header
+{
+    char magic[8];
+    uint64_t num_entries;
+    uint64_t names_size;
+    uint64_t data_size;
+} pak_header;
+
+#define PAK_MAX_TABLES (256 * 1024 * 1024) // entry and name tables read from a stream, about 8 million entries
+
+typedef struct pak_entry
+{
+    uint64_t offset; // offset of the data from the start of the pack
+    uint64_t size;
+    uint64_t name_offset; // offset of the path relative to the packed root in the name table ("" for the root itself)
+    uint32_t mode;
+    uint32_t type; // PAK_TYPE_DIR or PAK_TYPE_FILE
+} pak_entry;
+
+// entries and their source paths collected while walking the tree to pack
+typedef struct pak_list
+{
+    pak_entry *entries;
+    char **paths;
+    uint64_t num_entries;
+    uint64_t capacity;
+    char *names;
+    uint64_t names_size;
+    uint64_t names_capacity;
+} pak_list;
+
+// rounds a size up to the next multiple of 8 so the data section stays aligned
+uint64_t pak_pad(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+// copy exactly size bytes from one stage to the other, used to move file data in and out of packs
+int copy_stream_bytes(lz_reader *reader, lz_writer *writer, uint64_t size)
+{
+    char buffer[65536];
+    while (size > 0)
+    {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        ssize_t read_ret = lz_read(reader, buffer, chunk);
+        if (read_ret < 0) { return 1; }
+        if ((size_t)read_ret < chunk)
+        {
+            fprintf(stderr, "copy: Unable to read from file %s: file is shorter than expected\n", reader->name);
+            return 1;
+        }
+        if (lz_write(writer, buffer, chunk)) { return 1; }
+        size -= chunk;
+    }
+    return 0;
+}
+
+void pak_list_free(pak_list *list)
+{
+    for (uint64_t i = 0; i < list->num_entries; i++) { free(list->paths[i]); }
+    free(list->entries);
+    free(list->paths);
+    free(list->names);
+}
+
+// append one entry to the list, growing the arrays as needed
+int pak_add(pak_list *list, const char *path, const char *relpath, uint32_t type, struct stat *stat_buffer)
+{
+    if (list->num_entries == list->capacity)
+    {
+        uint64_t capacity = list->capacity ? list->capacity * 2 : 64;
+        pak_entry *entries = realloc(list->entries, capacity * sizeof(pak_entry));
+        if (entries == NULL) { return 1; }
+        list->entries = entries;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) { return 1; }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    size_t name_len = strlen(relpath) + 1;
+    if (list->names_size + name_len > list->names_capacity)
+    {
+        uint64_t capacity = list->names_capacity ? list->names_capacity * 2 : 4096;
+        while (capacity < list->names_size + name_len) { capacity *= 2; }
+        char *names = realloc(list->names, capacity);
+        if (names == NULL) { return 1; }
+        list->names = names;
+        list->names_capacity = capacity;
+    }
+    char *path_copy = strdup(path);
+    if (path_copy == NULL) { return 1; }
+    pak_entry *entry = &list->entries[list->num_entries];
+    entry->offset = 0;
+    entry->size = (type == PAK_TYPE_FILE) ? (uint64_t)stat_buffer->st_size : 0;
+    entry->name_offset = list->names_size;
+    entry->mode = stat_buffer->st_mode & 07777;
+    entry->type = type;
+    memcpy(list->names + list->names_size, relpath, name_len);
+    list->names_size += name_len;
+    list->paths[list->num_entries] = path_copy;
+    list->num_entries++;
+    return 0;
+}
+
+// records one entry of the source tree, the data is only read once the header has been written
+int pack_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    if (d_type != 4 && d_type != 8)
+    {
+        fprintf(stderr, "copy: Unable to pack file %s: file is not a regular file or directory\n", path);
+        return 1;
+    }
+    struct stat stat_buffer;
+    if (stat(path, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (pak_add(arg, path, relpath, d_type, &stat_buffer))
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        return 1;
+    }
+    return 0;
+}
+
+// pack source (a file or a directory tree) into pak_file
+// the tree is walked once to build the header, then the data of every file is streamed out in header order
+// with compress set the whole pack is run through the lz stage on its way out
+int pack_tree(char *pak_file, char *source_file, int compress)
+{
+    TRACE_SPAN("pack_tree");
+    pak_list list = {0};
+    struct stat stat_buffer;
+    if (stat(source_file, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source_file, strerror(errno));
+        return 1;
+    }
+    int walk_ret;
+    if (S_ISDIR(stat_buffer.st_mode))
+    {
+        char *dir_source = strdup(source_file);
+        if (dir_source == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+        size_t len = strlen(dir_source);
+        if (len > 1 && dir_source[len - 1] == '/') { dir_source[len - 1] = '\0'; } // remove trailing / if it exists
+        walk_ret = walk_directory("copy", dir_source, "", pack_visitor, &list);
+        free(dir_source);
+    }
+    else
+    {
+        walk_ret = pack_visitor(source_file, "", 8, &list);
+    }
+    if (walk_ret)
+    {
+        pak_list_free(&list);
+        return 1;
+    }
+
+    // lay out the data section now that every size is known
+    pak_header header;
+    memcpy(header.magic, PAK_MAGIC, 8);
+    header.num_entries = list.num_entries;
+    header.names_size = list.names_size;
+    uint64_t offset = sizeof(pak_header) + list.num_entries * sizeof(pak_entry) + pak_pad(list.names_size);
+    uint64_t data_start = offset;
+    for (uint64_t i = 0; i < list.num_entries; i++)
+    {
+        list.entries[i].offset = offset;
+        offset += list.entries[i].size;
+    }
+    header.data_size = offset - data_start;
+
+    int dest_fd = open(pak_file, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+    if (dest_fd < 0)
+    {
+        fprintf(stderr, "copy: Unable to create file %s: %s\n", pak_file, strerror(errno));
+        pak_list_free(&list);
+        return 1;
+    }
+    char padding[8] = {0};
+    lz_stats stats = {0};
+    lz_writer writer;
+    int pack_ret = lz_writer_open(&writer, dest_fd, pak_file, compress, offset, &stats);
+    if (!pack_ret)
+    {
+        pack_ret = lz_write(&writer, &header, sizeof(header)) ||
+                   lz_write(&writer, list.entries, list.num_entries * sizeof(pak_entry)) ||
+                   lz_write(&writer, list.names, list.names_size) ||
+                   lz_write(&writer, padding, pak_pad(list.names_size) - list.names_size);
+    }
+    int num_dir = 0;
+    int num_files = 0;
+    for (uint64_t i = 0; i < list.num_entries && !pack_ret; i++)
+    {
+        if (list.entries[i].type == PAK_TYPE_DIR)
+        {
+            num_dir++;
+            continue;
+        }
+        int input_fd = open(list.paths[i], O_RDONLY, 0);
+        if (input_fd < 0)
+        {
+            fprintf(stderr, "copy: Unable to open file %s: %s\n", list.paths[i], strerror(errno));
+            pack_ret = 1;
+            break;
+        }
+        lz_reader reader;
+        lz_reader_open(&reader, input_fd, list.paths[i], 0, &stats);
+        pack_ret = copy_stream_bytes(&reader, &writer, list.entries[i].size);
+        if (close(input_fd) < 0)
+        {
+            fprintf(stderr, "copy: Unable to close file %s: %s\n", list.paths[i], strerror(errno));
+            exit(1);
+        }
+        if (!pack_ret)
+        {
+            log_at(LOG_FILES, "%s -> %s\n", list.paths[i], pak_file);
+            num_files++;
+        }
+    }
+    if (lz_writer_close(&writer)) { pack_ret = 1; }
+    if (close(dest_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", pak_file, strerror(errno));
+        exit(1);
+    }
+    if (!pack_ret)
+    {
+        log_at(LOG_SUMMARY, "copy: packed %d directories, %d files, and %llu bytes from %s to %s\n",
+                num_dir, num_files, (unsigned long long)header.data_size, source_file, pak_file);
+        lz_report("compressed", &stats);
+    }
+    pak_list_free(&list);
+    return pack_ret;
+}
+
+// refuse names that would escape the destination directory
+int pak_name_is_safe(const char *name)
+{
+    if (name[0] == '/') { return 0; }
+    const char *component = name;
+    while (*component)
+    {
+        size_t len = strcspn(component, "/");
+        if ((len == 2 && !strncmp(component, "..", 2)) || (len == 1 && component[0] == '.') || len == 0) { return 0; }
+        component += len;
+        if (*component == '/') { component++; }
+    }
+    return 1;
+}
+
+// unpack pak_file into dest_file, recreating the tree that was packed
+// regular files are mmaped and every entry is written straight from its offset, pipes, fifos and compressed packs
+// are read sequentially through the lz stage
+int unpack_tree(char *pak_file, char *dest_file)
+{
+    TRACE_SPAN("unpack_tree");
+    int input_fd = open(pak_file, O_RDONLY, 0);
+    if (input_fd < 0)
+    {
+        fprintf(stderr, "copy: Unable to open file %s: %s\n", pak_file, strerror(errno));
+        return 1;
+    }
+    struct stat stat_buffer;
+    if (fstat(input_fd, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", pak_file, strerror(errno));
+        close(input_fd);
+        return 1;
+    }
+    char *map = NULL;
+    uint64_t map_size = 0;
+    if (S_ISREG(stat_buffer.st_mode) && stat_buffer.st_size > 0)
+    {
+        map_size = stat_buffer.st_size;
+        map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        if (map == MAP_FAILED) { map = NULL; } // fall back to reading it like a pipe
+        else if (map_size >= 8 && !memcmp(map, LZ_MAGIC, 8)) // compressed packs can only be read in order
+        {
+            munmap(map, map_size);
+            map = NULL;
+        }
+    }
+    lz_stats stats = {0};
+    lz_reader reader;
+    if (lz_reader_open(&reader, input_fd, pak_file, map == NULL, &stats))
+    {
+        lz_reader_close(&reader);
+        close(input_fd);
+        return 1;
+    }
+
+    // read the header, entry table and name table
+    pak_header header;
+    pak_entry *entries = NULL;
+    char *names = NULL;
+    uint64_t position = 0; // how far into the pack a streaming read has gotten
+    int unpack_ret = 0;
+    if (map != NULL && map_size >= sizeof(header)) { memcpy(&header, map, sizeof(header)); }
+    else if (map != NULL || lz_read(&reader, &header, sizeof(header)) != sizeof(header)) { unpack_ret = 1; }
+    // the tables have to fit in the mapped file, and a stream can not make us allocate more than PAK_MAX_TABLES
+    uint64_t table_size = header.num_entries * sizeof(pak_entry);
+    uint64_t names_size = pak_pad(header.names_size);
+    if (unpack_ret || memcmp(header.magic, PAK_MAGIC, 8) || header.num_entries > UINT32_MAX || header.names_size > UINT32_MAX ||
+        (map != NULL ? sizeof(header) + table_size + names_size > map_size : table_size + names_size > PAK_MAX_TABLES))
+    {
+        fprintf(stderr, "copy: Unable to unpack %s: not a pack file\n", pak_file);
+        if (map != NULL) { munmap(map, map_size); }
+        lz_reader_close(&reader);
+        close(input_fd);
+        return 1;
+    }
+    position = sizeof(header) + table_size + names_size;
+    entries = malloc(table_size + 1);
+    names = malloc(names_size + 1);
+    if (entries == NULL || names == NULL)
+    {
+        fprintf(stderr, "copy: Unable to unpack %s: Unable to allocate memory for its tables\n", pak_file);
+        unpack_ret = 1;
+    }
+    else if (map != NULL)
+    {
+        memcpy(entries, map + sizeof(header), table_size);
+        memcpy(names, map + sizeof(header) + table_size, names_size);
+    }
+    else if (lz_read(&reader, entries, table_size) != (ssize_t)table_size ||
+             lz_read(&reader, names, names_size) != (ssize_t)names_size)
+    {
+        fprintf(stderr, "copy: Unable to unpack %s: pack is truncated\n", pak_file);
+        unpack_ret = 1;
+    }
+
+    int num_dir = 0;
+    int num_files = 0;
+    for (uint64_t i = 0; i < header.num_entries && !unpack_ret; i++)
+    {
+        pak_entry *entry = &entries[i];
+        const char *name = names + entry->name_offset;
+        if (entry->name_offset >= header.names_size || !memchr(name, '\0', header.names_size - entry->name_offset) ||
+            (name[0] && !pak_name_is_safe(name)) || (entry->type != PAK_TYPE_DIR && entry->type != PAK_TYPE_FILE) ||
+            (map != NULL ? (entry->offset > map_size || entry->size > map_size - entry->offset) : entry->offset != position))
+        {
+            fprintf(stderr, "copy: Unable to unpack %s: entry %llu is corrupt\n", pak_file, (unsigned long long)i);
+            unpack_ret = 1;
+            break;
+        }
+        char *copy_to = join_path(dest_file, name);
+        if (copy_to == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+        if (entry->type == PAK_TYPE_DIR)
+        {
+            if (mkdir(copy_to, entry->mode) < 0)
+            {
+                fprintf(stderr, "copy: Unable to create directory %s: %s\n", copy_to, strerror(errno));
+                unpack_ret = 1;
+            }
+            else { num_dir++; }
+        }
+        else
+        {
+            int dest_fd = open(copy_to, O_CREAT|O_WRONLY|O_TRUNC, entry->mode);
+            if (dest_fd < 0)
+            {
+                fprintf(stderr, "copy: Unable to create file %s: %s\n", copy_to, strerror(errno));
+                unpack_ret = 1;
+            }
+            else
+            {
+                if (map != NULL)
+                {
+                    if (write_all(dest_fd, map + entry->offset, entry->size) < 0)
+                    {
+                        fprintf(stderr, "copy: Unable to write to file %s: %s\n", copy_to, strerror(errno));
+                        unpack_ret = 1;
+                    }
+                }
+                else
+                {
+                    lz_writer writer;
+                    lz_writer_open(&writer, dest_fd, copy_to, 0, entry->size, &stats);
+                    unpack_ret = copy_stream_bytes(&reader, &writer, entry->size);
+                    lz_writer_close(&writer);
+                    position += entry->size;
+                }
+                if (close(dest_fd) < 0)
+                {
+                    fprintf(stderr, "copy: Unable to close file %s: %s\n", copy_to, strerror(errno));
+                    exit(1);
+                }
+                if (!unpack_ret) { num_files++; }
+            }
+        }
+        if (!unpack_ret) { log_at(LOG_FILES, "%s%s%s -> %s\n", pak_file, name[0] ? ":" : "", name, copy_to); }
+        free(copy_to);
+    }
+    char end_byte; // read a compressed pack through its end marker so the stats count it like the writer did
+    if (!unpack_ret && reader.compressed && lz_read(&reader, &end_byte, 1) < 0) { unpack_ret = 1; }
+    if (map != NULL) { munmap(map, map_size); }
+    lz_reader_close(&reader);
+    if (close(input_fd) < 0)
+    {
+        fprintf(stderr, "copy: Unable to close file %s: %s\n", pak_file, strerror(errno));
+        exit(1);
+    }
+    if (!unpack_ret)
+    {
+        log_at(LOG_SUMMARY, "copy: unpacked %d directories, %d files, and %llu bytes from %s to %s\n",
+                num_dir, num_files, (unsigned long long)header.data_size, pak_file, dest_file);
+        lz_report("decompressed", &stats);
+    }
+    free(entries);
+    free(names);
+    return unpack_ret;
+}
+
+// *** Disk usage
+
+// du walks a tree with walk_directory, the directories directly under the root are shared out between threads
+// and each thread walks its subtrees on its own. sizes come from statx without following symlinks
+#define DU_MAX_THREADS 16
+
+typedef struct du_totals
+{
+    uint64_t apparent_bytes;
+    uint64_t allocated_bytes;
+    uint64_t file_bytes; // apparent size of everything but directories, which is what a copy moves
+    uint64_t num_files;
+    uint64_t num_dirs;
+} du_totals;
+
+typedef struct du_subtree
+{
+    char *path;
+    uint64_t apparent_bytes;
+    uint64_t allocated_bytes;
+} du_subtree;
+
+#define DU_MAX_TOP 10000 // du -n asks for at most this many subtrees
+
+// everything the threads of one scan share
+typedef struct du_scan
+{
+    const char *cmd;
+    du_totals totals;
+    du_subtree *heap; // min heap of the top_n largest subtrees seen so far
+    int heap_size;
+    int top_n;
+    char **subdirs; // directories directly under the root, each one walked by a single thread
+    char **subdir_rels;
+    int num_subdirs;
+    int subdirs_capacity;
+    int next_subdir;
+    int failed;
+    pthread_mutex_t mutex;
+} du_scan;
+
+// per thread state: the directories on the path from the subtree being walked down to the current entry
+typedef struct du_walk
+{
+    du_scan *scan;
+    du_totals totals;
+    du_subtree *stack;
+    char **stack_rels;
+    int depth;
+    int capacity;
+    du_subtree finished; // sizes of subtrees that were popped off the bottom of the stack
+} du_walk;
+
+void du_swap(du_subtree *a, du_subtree *b)
+{
+    du_subtree tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// offer a finished subtree to the bounded heap, keeping only the top_n largest by apparent size
+void du_offer(du_scan *scan, const char *path, uint64_t apparent_bytes, uint64_t allocated_bytes)
+{
+    if (!scan->top_n) { return; }
+    pthread_mutex_lock(&scan->mutex);
+    du_subtree *heap = scan->heap;
+    int i;
+    if (scan->heap_size < scan->top_n)
+    {
+        i = scan->heap_size++;
+        heap[i] = (du_subtree){strdup(path), apparent_bytes, allocated_bytes};
+        while (i > 0 && heap[(i - 1) / 2].apparent_bytes > heap[i].apparent_bytes) // sift up
+        {
+            du_swap(&heap[(i - 1) / 2], &heap[i]);
+            i = (i - 1) / 2;
+        }
+    }
+    else if (apparent_bytes > heap[0].apparent_bytes)
+    {
+        free(heap[0].path);
+        heap[0] = (du_subtree){strdup(path), apparent_bytes, allocated_bytes};
+        i = 0;
+        while (1) // sift down
+        {
+            int smallest = i;
+            int left = 2 * i + 1;
+            int right = 2 * i + 2;
+            if (left < scan->heap_size && heap[left].apparent_bytes < heap[smallest].apparent_bytes) { smallest = left; }
+            if (right < scan->heap_size && heap[right].apparent_bytes < heap[smallest].apparent_bytes) { smallest = right; }
+            if (smallest == i) break;
+            du_swap(&heap[i], &heap[smallest]);
+            i = smallest;
+        }
+    }
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+// the directory on top of the stack is done, hand it to the heap and add its size to its parent
+void du_pop(du_walk *walk)
+{
+    du_subtree *top = &walk->stack[--walk->depth];
+    du_offer(walk->scan, top->path, top->apparent_bytes, top->allocated_bytes);
+    du_subtree *parent = walk->depth ? &walk->stack[walk->depth - 1] : &walk->finished;
+    parent->apparent_bytes += top->apparent_bytes;
+    parent->allocated_bytes += top->allocated_bytes;
+    free(top->path);
+    free(walk->stack_rels[walk->depth]);
+}
+
+// the walk is depth first, so every directory on the stack that does not contain relpath has been finished
+int du_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    du_walk *walk = arg;
+    while (walk->depth)
+    {
+        const char *top = walk->stack_rels[walk->depth - 1];
+        size_t len = strlen(top);
+        if (!len || (!strncmp(relpath, top, len) && relpath[len] == '/')) break;
+        du_pop(walk);
+    }
+    struct statx stat_buffer;
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_SIZE|STATX_BLOCKS, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "%s: Unable to stat file %s: %s\n", walk->scan->cmd, path, strerror(errno));
+        return 1;
+    }
+    uint64_t allocated_bytes = stat_buffer.stx_blocks * 512;
+    walk->totals.apparent_bytes += stat_buffer.stx_size;
+    walk->totals.allocated_bytes += allocated_bytes;
+    if (d_type == 4)
+    {
+        walk->totals.num_dirs++;
+        if (walk->depth == walk->capacity)
+        {
+            walk->capacity = walk->capacity ? walk->capacity * 2 : 32;
+            walk->stack = realloc(walk->stack, walk->capacity * sizeof(du_subtree));
+            walk->stack_rels = realloc(walk->stack_rels, walk->capacity * sizeof(char *));
+            if (walk->stack == NULL || walk->stack_rels == NULL)
+            {
+                fprintf(stderr, "%s: Unable to allocate memory: exiting program\n", walk->scan->cmd);
+                exit(1);
+            }
+        }
+        walk->stack[walk->depth] = (du_subtree){strdup(path), stat_buffer.stx_size, allocated_bytes};
+        walk->stack_rels[walk->depth] = strdup(relpath);
+        walk->depth++;
+        return 0;
+    }
+    walk->totals.num_files++;
+    walk->totals.file_bytes += stat_buffer.stx_size;
+    du_subtree *parent = walk->depth ? &walk->stack[walk->depth - 1] : &walk->finished;
+    parent->apparent_bytes += stat_buffer.stx_size;
+    parent->allocated_bytes += allocated_bytes;
+    return 0;
+}
+
+// visitor for the root directory itself: files are counted here and subdirectories are queued for the threads
+int du_root_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    du_walk *walk = arg;
+    if (d_type != 4 || !relpath[0]) { return du_visitor(path, relpath, d_type, arg); }
+    du_scan *scan = walk->scan;
+    if (scan->num_subdirs == scan->subdirs_capacity)
+    {
+        scan->subdirs_capacity = scan->subdirs_capacity ? scan->subdirs_capacity * 2 : 64;
+        scan->subdirs = realloc(scan->subdirs, scan->subdirs_capacity * sizeof(char *));
+        scan->subdir_rels = realloc(scan->subdir_rels, scan->subdirs_capacity * sizeof(char *));
+        if (scan->subdirs == NULL || scan->subdir_rels == NULL)
+        {
+            fprintf(stderr, "%s: Unable to allocate memory: exiting program\n", scan->cmd);
+            exit(1);
+        }
+    }
+    scan->subdirs[scan->num_subdirs] = strdup(path);
+    scan->subdir_rels[scan->num_subdirs] = strdup(relpath);
+    scan->num_subdirs++;
+    return WALK_SKIP;
+}
+
+void du_walk_finish(du_walk *walk)
+{
+    while (walk->depth) { du_pop(walk); }
+    free(walk->stack);
+    free(walk->stack_rels);
+    du_scan *scan = walk->scan;
+    pthread_mutex_lock(&scan->mutex);
+    scan->totals.apparent_bytes += walk->totals.apparent_bytes;
+    scan->totals.allocated_bytes += walk->totals.allocated_bytes;
+    scan->totals.file_bytes += walk->totals.file_bytes;
+    scan->totals.num_files += walk->totals.num_files;
+    scan->totals.num_dirs += walk->totals.num_dirs;
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+void *du_worker_main(void *arg)
+{
+    du_scan *scan = arg;
+    while (1)
+    {
+        int i = __atomic_fetch_add(&scan->next_subdir, 1, __ATOMIC_RELAXED);
+        if (i >= scan->num_subdirs) break;
+        du_walk walk = {scan};
+        if (walk_directory(scan->cmd, scan->subdirs[i], scan->subdir_rels[i], du_visitor, &walk))
+        {
+            __atomic_store_n(&scan->failed, 1, __ATOMIC_RELAXED);
+        }
+        du_walk_finish(&walk);
+    }
+    return NULL;
+}
+
+int du_compare(const void *a, const void *b)
+{
+    const du_subtree *x = a;
+    const du_subtree *y = b;
+    return x->apparent_bytes < y->apparent_bytes ? 1 : (x->apparent_bytes > y->apparent_bytes ? -1 : 0);
+}
+
+// scan source (a file or a directory tree) and fill in totals. with top_n set the largest subtrees are
+// returned in largest, sorted biggest first, and the caller frees them with du_free_subtrees
+int du_tree(const char *cmd, const char *source, du_totals *totals, int top_n, du_subtree **largest, int *num_largest)
+{
+    TRACE_SPAN("du_tree");
+    du_scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.cmd = cmd;
+    scan.top_n = top_n;
+    pthread_mutex_init(&scan.mutex, NULL);
+    if (top_n)
+    {
+        scan.heap = malloc(top_n * sizeof(du_subtree));
+        if (scan.heap == NULL)
+        {
+            fprintf(stderr, "%s: Unable to allocate memory: %s\n", cmd, strerror(errno));
+            pthread_mutex_destroy(&scan.mutex);
+            return 1;
+        }
+    }
+    struct stat stat_buffer;
+    if (stat(source, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "%s: Unable to stat file %s: %s\n", cmd, source, strerror(errno));
+        free(scan.heap);
+        return 1;
+    }
+    char *root = strdup(source);
+    size_t len = strlen(root);
+    if (len > 1 && root[len - 1] == '/') { root[len - 1] = '\0'; } // remove trailing / if it exists
+    du_walk root_walk = {&scan};
+    if (!S_ISDIR(stat_buffer.st_mode))
+    {
+        scan.failed = du_visitor(root, "", 8, &root_walk);
+        du_walk_finish(&root_walk);
+    }
+    else
+    {
+        scan.failed = walk_directory(cmd, root, "", du_root_visitor, &root_walk);
+        // the root stays on its stack until the threads have added in the subtrees beneath it
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int num_threads = cpus < 1 ? 1 : (cpus > DU_MAX_THREADS ? DU_MAX_THREADS : cpus);
+        if (num_threads > scan.num_subdirs) { num_threads = scan.num_subdirs; }
+        pthread_t threads[DU_MAX_THREADS];
+        int created[DU_MAX_THREADS] = {0};
+        for (int i = 1; i < num_threads; i++) { created[i] = pthread_create(&threads[i], NULL, du_worker_main, &scan) == 0; }
+        du_worker_main(&scan); // this thread takes a share of the subtrees too, and any a thread could not start for
+        for (int i = 1; i < num_threads; i++) { if (created[i]) { pthread_join(threads[i], NULL); } }
+        uint64_t subtree_apparent = 0;
+        uint64_t subtree_allocated = 0;
+        pthread_mutex_lock(&scan.mutex);
+        subtree_apparent = scan.totals.apparent_bytes;
+        subtree_allocated = scan.totals.allocated_bytes;
+        pthread_mutex_unlock(&scan.mutex);
+        if (root_walk.depth)
+        {
+            root_walk.stack[0].apparent_bytes += subtree_apparent;
+            root_walk.stack[0].allocated_bytes += subtree_allocated;
+        }
+        du_walk_finish(&root_walk);
+        for (int i = 0; i < scan.num_subdirs; i++)
+        {
+            free(scan.subdirs[i]);
+            free(scan.subdir_rels[i]);
+        }
+        free(scan.subdirs);
+        free(scan.subdir_rels);
+    }
+    free(root);
+    pthread_mutex_destroy(&scan.mutex);
+    *totals = scan.totals;
+    if (top_n)
+    {
+        qsort(scan.heap, scan.heap_size, sizeof(du_subtree), du_compare);
+        *largest = scan.heap;
+        *num_largest = scan.heap_size;
+    }
+    return scan.failed;
+}
+
+void du_free_subtrees(du_subtree *subtrees, int num_subtrees)
+{
+    for (int i = 0; i < num_subtrees; i++) { free(subtrees[i].path); }
+    free(subtrees);
+}
+
+// the du builtin: print the totals for a tree and optionally its top_n largest subtrees
+int disk_usage(const char *source, int top_n)
+{
+    du_totals totals;
+    du_subtree *largest = NULL;
+    int num_largest = 0;
+    double start = monotonic_seconds();
+    int du_ret = du_tree("du", source, &totals, top_n, &largest, &num_largest);
+    double elapsed = monotonic_seconds() - start;
+    printf("du: %llu directories, %llu files, %llu bytes apparent, %llu bytes allocated in %s (scanned in %.3fs)%s\n",
+            (unsigned long long)totals.num_dirs, (unsigned long long)totals.num_files,
+            (unsigned long long)totals.apparent_bytes, (unsigned long long)totals.allocated_bytes, source, elapsed,
+            du_ret ? ", totals are incomplete" : "");
+    for (int i = 0; i < num_largest; i++)
+    {
+        printf("%15llu %15llu  %s\n", (unsigned long long)largest[i].apparent_bytes,
+                (unsigned long long)largest[i].allocated_bytes, largest[i].path);
+    }
+    if (largest != NULL) { du_free_subtrees(largest, num_largest); }
+    return du_ret;
+}
+
+// *** Content search
+
+// search walks a tree with walk_directory to list the files, then threads take files in turn, mmap them and look for
+// a literal pattern. candidates are found by comparing the first and last byte of the pattern against 16 or 32
+// positions at once and only those get a full memcmp. results are printed in the order the walk found the files
+#define SEARCH_MAX_THREADS 16
+#define SEARCH_BINARY_CHECK 8192 // a NUL byte in this many leading bytes marks a file as binary
+
+// what one file produced, filled in by a worker and printed by the main thread
+typedef struct search_result
+{
+    char *output;
+    size_t output_len;
+    uint64_t bytes;
+    int matches;
+    int binary;
+    int done;
+} search_result;
+
+typedef struct search_job
+{
+    const char *pattern;
+    size_t pattern_len;
+    char **paths;
+    search_result *results;
+    int num_files;
+    int capacity;
+    int next_file;
+    pthread_mutex_t mutex;
+    pthread_cond_t file_done;
+} search_job;
+
+// plain loop used on other architectures and for the tail the vector loops leave behind
+const char *search_scalar(const char *hay, size_t n, const char *pattern, size_t m)
+{
+    const char *end = hay + n - m + 1;
+    for (const char *p = hay; p < end; p++)
+    {
+        p = memchr(p, pattern[0], end - p);
+        if (p == NULL) { return NULL; }
+        if (p[m - 1] == pattern[m - 1] && !memcmp(p, pattern, m)) { return p; }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *search_sse2(const char *hay, size_t n, const char *pattern, size_t m)
+{
+    __m128i first = _mm_set1_epi8(pattern[0]);
+    __m128i last = _mm_set1_epi8(pattern[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(hay + i + bit, pattern, m)) { return hay + i + bit; }
+            mask &= mask - 1;
+        }
+    }
+    return i + m <= n ? search_scalar(hay + i, n - i, pattern, m) : NULL;
+}
+
+__attribute__((target("avx2")))
+const char *search_avx2(const char *hay, size_t n, const char *pattern, size_t m)
+{
+    __m256i first = _mm256_set1_epi8(pattern[0]);
+    __m256i last = _mm256_set1_epi8(pattern[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(hay + i + bit, pattern, m)) { return hay + i + bit; }
+            mask &= mask - 1;
+        }
+    }
+    return i + m <= n ? search_scalar(hay + i, n - i, pattern, m) : NULL;
+}
+#endif
+
+// find the first occurrence of pattern in hay, using the widest vector unit the cpu has
+const char *search_find(const char *hay, size_t n, const char *pattern, size_t m)
+{
+    if (m > n) { return NULL; }
+#if defined(__x86_64__) || defined(__i386__)
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) { use_avx2 = __builtin_cpu_supports("avx2"); }
+    return use_avx2 ? search_avx2(hay, n, pattern, m) : search_sse2(hay, n, pattern, m);
+#else
+    return search_scalar(hay, n, pattern, m);
+#endif
+}
+
+// search one file, writing "path:line:text" for every matching line into the result
+void search_file(search_job *job, const char *path, search_result *result)
+{
+    TRACE_SPAN("search_file");
+    int input_fd = open(path, O_RDONLY, 0);
+    if (input_fd < 0)
+    {
+        fprintf(stderr, "search: Unable to open file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    struct stat stat_buffer;
+    if (fstat(input_fd, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "search: Unable to stat file %s: %s\n", path, strerror(errno));
+        close(input_fd);
+        return;
+    }
+    size_t size = stat_buffer.st_size;
+    if (!size)
+    {
+        close(input_fd);
+        return;
+    }
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    close(input_fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "search: Unable to map file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    result->bytes = size;
+    if (memchr(map, '\0', size < SEARCH_BINARY_CHECK ? size : SEARCH_BINARY_CHECK))
+    {
+        result->binary = 1;
+        munmap((void *)map, size);
+        return;
+    }
+    FILE *output = NULL;
+    size_t pos = 0;
+    size_t line_number = 1;
+    size_t counted = 0; // newlines before this offset are included in line_number
+    while (pos < size)
+    {
+        const char *match = search_find(map + pos, size - pos, job->pattern, job->pattern_len);
+        if (match == NULL) break;
+        size_t offset = match - map;
+        const char *line_start = memrchr(map, '\n', offset);
+        line_start = line_start ? line_start + 1 : map;
+        const char *line_end = memchr(match, '\n', size - offset);
+        if (line_end == NULL) { line_end = map + size; }
+        for (const char *p = map + counted; (p = memchr(p, '\n', line_start - p)) != NULL; p++) { line_number++; }
+        counted = line_start - map;
+        if (output == NULL && (output = open_memstream(&result->output, &result->output_len)) == NULL)
+        {
+            fprintf(stderr, "search: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+        fprintf(output, "%s:%zu:%.*s\n", path, line_number, (int)(line_end - line_start), line_start);
+        result->matches++;
+        pos = line_end - map + 1; // one report per line
+    }
+    if (output != NULL) { fclose(output); }
+    munmap((void *)map, size);
+}
+
+void *search_worker_main(void *arg)
+{
+    search_job *job = arg;
+    while (1)
+    {
+        int i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED);
+        if (i >= job->num_files) break;
+        search_file(job, job->paths[i], &job->results[i]);
+        pthread_mutex_lock(&job->mutex);
+        job->results[i].done = 1;
+        pthread_cond_signal(&job->file_done);
+        pthread_mutex_unlock(&job->mutex);
+    }
+    return NULL;
+}
+
+// collects the regular files of the tree in walk order, anything else is left out
+int search_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    search_job *job = arg;
+    if (d_type != 8) { return 0; }
+    if (job->num_files == job->capacity)
+    {
+        job->capacity = job->capacity ? job->capacity * 2 : 256;
+        job->paths = realloc(job->paths, job->capacity * sizeof(char *));
+        if (job->paths == NULL)
+        {
+            fprintf(stderr, "search: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+    }
+    job->paths[job->num_files] = strdup(path);
+    if (job->paths[job->num_files] == NULL)
+    {
+        fprintf(stderr, "search: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    job->num_files++;
+    return 0;
+}
+
+// the search builtin: print every line containing pattern in the files under source
+int search_tree(const char *pattern, const char *source)
+{
+    search_job job;
+    memset(&job, 0, sizeof(job));
+    job.pattern = pattern;
+    job.pattern_len = strlen(pattern);
+    double start = monotonic_seconds();
+    struct stat stat_buffer;
+    if (stat(source, &stat_buffer) == -1)
+    {
+        fprintf(stderr, "search: Unable to stat file %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+    int walk_ret = 0;
+    if (S_ISDIR(stat_buffer.st_mode))
+    {
+        char *root = strdup(source);
+        size_t len = strlen(root);
+        if (len > 1 && root[len - 1] == '/') { root[len - 1] = '\0'; } // remove trailing / if it exists
+        walk_ret = walk_directory("search", root, "", search_visitor, &job);
+        free(root);
+    }
+    else { search_visitor(source, "", 8, &job); }
+
+    job.results = calloc(job.num_files ? job.num_files : 1, sizeof(search_result));
+    if (job.results == NULL)
+    {
+        fprintf(stderr, "search: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.file_done, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cpus < 1 ? 1 : (cpus > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : cpus);
+    if (num_threads > job.num_files) { num_threads = job.num_files; }
+    pthread_t threads[SEARCH_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&threads[started], NULL, search_worker_main, &job) == 0) { started++; }
+    }
+    if (!started) { search_worker_main(&job); } // no threads at all, search everything here
+
+    // print the results in walk order as soon as each file is finished
+    uint64_t bytes = 0;
+    int matches = 0;
+    int matching_files = 0;
+    int binary_files = 0;
+    for (int i = 0; i < job.num_files; i++)
+    {
+        search_result *result = &job.results[i];
+        pthread_mutex_lock(&job.mutex);
+        while (!result->done) { pthread_cond_wait(&job.file_done, &job.mutex); }
+        pthread_mutex_unlock(&job.mutex);
+        if (result->output != NULL)
+        {
+            fwrite(result->output, 1, result->output_len, stdout);
+            free(result->output);
+            matching_files++;
+        }
+        bytes += result->bytes;
+        matches += result->matches;
+        binary_files += result->binary;
+        free(job.paths[i]);
+    }
+    for (int i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+    double elapsed = monotonic_seconds() - start;
+    printf("search: %d matches in %d files, scanned %llu bytes in %d files at %.1f MB/s (%d binary files skipped)\n",
+            matches, matching_files, (unsigned long long)bytes, job.num_files,
+            elapsed > 0 ? bytes / elapsed / 1048576.0 : 0, binary_files);
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.file_done);
+    free(job.paths);
+    free(job.results);
+    return walk_ret;
+}
+
+// *** Mirrors
+
+// copy --watch keeps dst in step with src. the first pass walks src with walk_directory, adding an inotify watch on
+// every directory before copying into it and copying only files that are missing or out of date in dst
+// after that a thread reads the events, collects them by path so a burst on one file becomes one entry, and once
+// a path has been quiet for MIRROR_DEBOUNCE seconds it is copied again, resynced if it is a directory or removed
+#define MIRROR_MAX 16
+#define MIRROR_DEBOUNCE 0.2
+#define MIRROR_EVENTS (IN_CLOSE_WRITE|IN_CREATE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_ATTRIB)
+
+typedef struct mirror_pending
+{
+    char *relpath;
+    double first_event;
+    double last_event;
+} mirror_pending;
+
+typedef struct mirror
+{
+    char *source;
+    char *dest;
+    int inotify_fd;
+    char **watch_rels; // indexed by watch descriptor
+    int watch_capacity;
+    int num_watches;
+    mirror_pending *pending;
+    int num_pending;
+    int pending_capacity;
+    int *pending_index; // open addressing table of positions in pending, sized pending_index_slots
+    int pending_index_slots;
+    copy_info copy_info;
+    // shown by the status builtin, guarded by mutex
+    pthread_mutex_t mutex;
+    uint64_t events;
+    uint64_t updates;
+    int backlog;
+    double last_lag;
+    double max_lag;
+    double total_lag;
+} mirror;
+
+mirror *mirrors[MIRROR_MAX];
+int num_mirrors;
+
+// remember which directory a watch descriptor belongs to, a directory moved within the tree gets its new name here
+void mirror_set_watch(mirror *mirror, int wd, const char *relpath)
+{
+    if (wd >= mirror->watch_capacity)
+    {
+        int capacity = mirror->watch_capacity ? mirror->watch_capacity : 64;
+        while (capacity <= wd) { capacity *= 2; }
+        mirror->watch_rels = realloc(mirror->watch_rels, capacity * sizeof(char *));
+        if (mirror->watch_rels == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+        memset(mirror->watch_rels + mirror->watch_capacity, 0, (capacity - mirror->watch_capacity) * sizeof(char *));
+        mirror->watch_capacity = capacity;
+    }
+    if (mirror->watch_rels[wd] == NULL) { mirror->num_watches++; }
+    free(mirror->watch_rels[wd]);
+    mirror->watch_rels[wd] = strdup(relpath);
+}
+
+// walk visitor that brings one entry of dst up to date and watches every source directory
+int mirror_sync_visitor(const char *path, const char *relpath, unsigned char d_type, void *arg)
+{
+    mirror *mirror = arg;
+    char *copy_to = join_path(mirror->dest, relpath);
+    if (copy_to == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        return 1;
+    }
+    int sync_ret = 0;
+    struct stat source_stat;
+    struct stat dest_stat;
+    if (stat(path, &source_stat) == -1)
+    {
+        fprintf(stderr, "copy: Unable to stat file %s: %s\n", path, strerror(errno));
+        sync_ret = 1;
+    }
+    else if (d_type == 4)
+    {
+        int wd = inotify_add_watch(mirror->inotify_fd, path, MIRROR_EVENTS);
+        if (wd < 0)
+        {
+            fprintf(stderr, "copy: Unable to watch directory %s: %s\n", path, strerror(errno));
+            sync_ret = 1;
+        }
+        else { mirror_set_watch(mirror, wd, relpath); }
+        int mkdir_ret = sync_ret ? 0 : mkdir(copy_to, source_stat.st_mode);
+        if (mkdir_ret < 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "copy: Unable to create directory %s: %s\n", copy_to, strerror(errno));
+            sync_ret = 1;
+        }
+        else if (!sync_ret && mkdir_ret == 0)
+        {
+            log_at(LOG_FILES, "%s -> %s\n", path, copy_to);
+            mirror->copy_info.num_dir++;
+        }
+    }
+    else if (d_type == 8)
+    {
+        // filecopy never leaves dst older than src, so anything newer in src has changed since
+        if (stat(copy_to, &dest_stat) == -1 || dest_stat.st_size != source_stat.st_size ||
+            dest_stat.st_mtim.tv_sec < source_stat.st_mtim.tv_sec ||
+            (dest_stat.st_mtim.tv_sec == source_stat.st_mtim.tv_sec && dest_stat.st_mtim.tv_nsec < source_stat.st_mtim.tv_nsec))
+        {
+            sync_ret = filecopy(path, copy_to, &mirror->copy_info);
+        }
+    }
+    free(copy_to);
+    return sync_ret;
+}
+
+// bring the subtree at relpath up to date, errors are reported but the rest of the tree is still synced
+int mirror_sync(mirror *mirror, const char *relpath)
+{
+    char *path = join_path(mirror->source, relpath);
+    if (path == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    int sync_ret = walk_directory("copy", path, relpath, mirror_sync_visitor, mirror);
+    free(path);
+    return sync_ret;
+}
+
+int mirror_remove_entry(const char *path, const struct stat *stat_buffer, int type, struct FTW *ftw)
+{
+    if (remove(path) < 0) { fprintf(stderr, "copy: Unable to remove %s: %s\n", path, strerror(errno)); }
+    return 0;
+}
+
+// index of relpath in the pending list, or -1. also returns the free slot it would go in
+int mirror_find_pending(mirror *mirror, const char *relpath, int *slot)
+{
+    for (uint32_t i = string_hash(relpath); ; i++)
+    {
+        int *index = &mirror->pending_index[i & (mirror->pending_index_slots - 1)];
+        if (*index < 0)
+        {
+            *slot = index - mirror->pending_index;
+            return -1;
+        }
+        if (!strcmp(mirror->pending[*index].relpath, relpath)) { return *index; }
+    }
+}
+
+void mirror_rebuild_index(mirror *mirror)
+{
+    int slots = 64;
+    while (slots < mirror->num_pending * 2 + 2) { slots *= 2; }
+    if (slots != mirror->pending_index_slots)
+    {
+        mirror->pending_index = realloc(mirror->pending_index, slots * sizeof(int));
+        if (mirror->pending_index == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+        mirror->pending_index_slots = slots;
+    }
+    memset(mirror->pending_index, -1, slots * sizeof(int));
+    for (int i = 0; i < mirror->num_pending; i++)
+    {
+        int slot;
+        mirror_find_pending(mirror, mirror->pending[i].relpath, &slot);
+        mirror->pending_index[slot] = i;
+    }
+}
+
+// add a path to the work queue, or just note the new event if it is already queued
+void mirror_queue(mirror *mirror, const char *relpath, double now)
+{
+    int slot;
+    int i = mirror_find_pending(mirror, relpath, &slot);
+    if (i >= 0)
+    {
+        mirror->pending[i].last_event = now;
+        return;
+    }
+    if (mirror->num_pending == mirror->pending_capacity)
+    {
+        mirror->pending_capacity = mirror->pending_capacity ? mirror->pending_capacity * 2 : 64;
+        mirror->pending = realloc(mirror->pending, mirror->pending_capacity * sizeof(mirror_pending));
+        if (mirror->pending == NULL)
+        {
+            fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+            exit(1);
+        }
+    }
+    mirror->pending[mirror->num_pending] = (mirror_pending){strdup(relpath), now, now};
+    mirror->pending_index[slot] = mirror->num_pending++;
+    if (mirror->num_pending * 2 + 2 > mirror->pending_index_slots) { mirror_rebuild_index(mirror); }
+}
+
+// copy, resync or remove one path that has settled down
+void mirror_update(mirror *mirror, const char *relpath)
+{
+    TRACE_SPAN("mirror_update");
+    char *path = join_path(mirror->source, relpath);
+    char *copy_to = join_path(mirror->dest, relpath);
+    if (path == NULL || copy_to == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    struct stat stat_buffer;
+    if (lstat(path, &stat_buffer) == -1)
+    {
+        if (errno == ENOENT) // gone from src, so it goes from dst too
+        {
+            if (nftw(copy_to, mirror_remove_entry, 16, FTW_DEPTH|FTW_PHYS) == 0) { log_at(LOG_FILES, "removed %s\n", copy_to); }
+        }
+        else { fprintf(stderr, "copy: Unable to stat file %s: %s\n", path, strerror(errno)); }
+    }
+    else if (S_ISDIR(stat_buffer.st_mode)) { mirror_sync(mirror, relpath); }
+    else if (S_ISREG(stat_buffer.st_mode)) { filecopy(path, copy_to, &mirror->copy_info); }
+    free(path);
+    free(copy_to);
+}
+
+void *mirror_main(void *arg)
+{
+    mirror *mirror = arg;
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds = {mirror->inotify_fd, POLLIN, 0};
+    while (1)
+    {
+        int poll_ret = poll(&fds, 1, mirror->num_pending ? 50 : -1);
+        double now = monotonic_seconds();
+        if (poll_ret > 0)
+        {
+            ssize_t read_ret = read(mirror->inotify_fd, buffer, sizeof(buffer));
+            for (char *p = buffer; read_ret > 0 && p < buffer + read_ret; )
+            {
+                struct inotify_event *event = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + event->len;
+                pthread_mutex_lock(&mirror->mutex);
+                mirror->events++;
+                pthread_mutex_unlock(&mirror->mutex);
+                if (event->mask & IN_Q_OVERFLOW) // events were lost, the only safe thing is to look at everything
+                {
+                    mirror_queue(mirror, "", now);
+                    continue;
+                }
+                if (event->wd >= mirror->watch_capacity || mirror->watch_rels[event->wd] == NULL) { continue; }
+                if (event->mask & IN_IGNORED) // the directory is gone and so is its watch
+                {
+                    free(mirror->watch_rels[event->wd]);
+                    mirror->watch_rels[event->wd] = NULL;
+                    mirror->num_watches--;
+                    continue;
+                }
+                if (!event->len) { continue; }
+                const char *dir_rel = mirror->watch_rels[event->wd];
+                char *relpath = dir_rel[0] ? join_path(dir_rel, event->name) : strdup(event->name);
+                if (relpath == NULL)
+                {
+                    fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+                    exit(1);
+                }
+                mirror_queue(mirror, relpath, now);
+                free(relpath);
+            }
+        }
+        // handle every path that has been quiet long enough, in the order they first changed
+        int kept = 0;
+        for (int i = 0; i < mirror->num_pending; i++)
+        {
+            mirror_pending *pending = &mirror->pending[i];
+            if (now - pending->last_event < MIRROR_DEBOUNCE)
+            {
+                mirror->pending[kept++] = *pending;
+                continue;
+            }
+            mirror_update(mirror, pending->relpath);
+            double lag = monotonic_seconds() - pending->first_event;
+            pthread_mutex_lock(&mirror->mutex);
+            mirror->updates++;
+            mirror->last_lag = lag;
+            mirror->total_lag += lag;
+            if (lag > mirror->max_lag) { mirror->max_lag = lag; }
+            pthread_mutex_unlock(&mirror->mutex);
+            free(pending->relpath);
+        }
+        if (kept != mirror->num_pending)
+        {
+            mirror->num_pending = kept;
+            mirror_rebuild_index(mirror);
+        }
+        pthread_mutex_lock(&mirror->mutex);
+        mirror->backlog = mirror->num_pending;
+        pthread_mutex_unlock(&mirror->mutex);
+    }
+    return NULL;
+}
+
+// copy --watch: copy src to dst and keep it up to date in the background
+// frees a mirror that never started watching, closing the inotify descriptor drops its watches
+void mirror_free(mirror *mirror)
+{
+    close(mirror->inotify_fd);
+    for (int i = 0; i < mirror->watch_capacity; i++) { free(mirror->watch_rels[i]); }
+    free(mirror->watch_rels);
+    for (int i = 0; i < mirror->num_pending; i++) { free(mirror->pending[i].relpath); }
+    free(mirror->pending);
+    free(mirror->pending_index);
+    pthread_mutex_destroy(&mirror->mutex);
+    free(mirror->source);
+    free(mirror->dest);
+    free(mirror);
+}
+
+int watch_tree(char *source_file, char *dest_file)
+{
+    if (num_mirrors == MIRROR_MAX)
+    {
+        fprintf(stderr, "copy: Unable to watch %s: already mirroring %d trees\n", source_file, MIRROR_MAX);
+        return 1;
+    }
+    mirror *mirror = calloc(1, sizeof(*mirror));
+    if (mirror == NULL)
+    {
+        fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
+        exit(1);
+    }
+    // the thread keeps running after a chdir, so it needs absolute paths
+    mirror->source = realpath(source_file, NULL);
+    if (mirror->source == NULL)
+    {
+        fprintf(stderr, "copy: Unable to find directory %s: %s\n", source_file, strerror(errno));
+        free(mirror);
+        return 1;
+    }
+    struct stat stat_buffer;
+    if (stat(mirror->source, &stat_buffer) == -1 || !S_ISDIR(stat_buffer.st_mode))
+    {
+        fprintf(stderr, "copy: Unable to watch %s: only directories can be watched\n", source_file);
+        free(mirror->source);
+        free(mirror);
+        return 1;
+    }
+    int created = mkdir(dest_file, stat_buffer.st_mode) == 0;
+    if (!created && errno != EEXIST)
+    {
+        fprintf(stderr, "copy: Unable to create directory %s: %s\n", dest_file, strerror(errno));
+        free(mirror->source);
+        free(mirror);
+        return 1;
+    }
+    mirror->dest = realpath(dest_file, NULL);
+    size_t source_len = strlen(mirror->source);
+    if (mirror->dest != NULL && (source_len == 1 || (!strncmp(mirror->dest, mirror->source, source_len) &&
+                                 (mirror->dest[source_len] == '/' || mirror->dest[source_len] == '\0'))))
+    {
+        // every copy into the mirror would be another change to mirror
+        fprintf(stderr, "copy: Unable to watch %s: the destination %s is inside it\n", source_file, dest_file);
+        if (created) { rmdir(mirror->dest); }
+        free(mirror->source);
+        free(mirror->dest);
+        free(mirror);
+        return 1;
+    }
+    mirror->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (mirror->dest == NULL || mirror->inotify_fd < 0)
+    {
+        fprintf(stderr, "copy: Unable to watch %s: %s\n", source_file, strerror(errno));
+        if (mirror->inotify_fd >= 0) { close(mirror->inotify_fd); }
+        free(mirror->source);
+        free(mirror->dest);
+        free(mirror);
+        return 1;
+    }
+    pthread_mutex_init(&mirror->mutex, NULL);
+    mirror_rebuild_index(mirror);
+    if (mirror_sync(mirror, ""))
+    {
+        mirror_free(mirror); // the first sync has to succeed before the tree is watched
+        return 1;
+    }
+    log_at(LOG_SUMMARY, "copy: copied %d directories, %d files, and %d bytes from %s to %s, watching %d directories\n",
+            mirror->copy_info.num_dir, mirror->copy_info.num_files, mirror->copy_info.num_bytes,
+            source_file, dest_file, mirror->num_watches);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mirror_main, mirror))
+    {
+        fprintf(stderr, "copy: Unable to start watching %s: %s\n", source_file, strerror(errno));
+        mirror_free(mirror);
+        return 1;
+    }
+    pthread_detach(thread);
+    mirrors[num_mirrors++] = mirror;
+    return 0;
+}
+
+// the status builtin: how far behind each mirror is
+void mirror_status()
+{
+    if (!num_mirrors)
+    {
+        printf("status: no trees are being watched\n");
+        return;
+    }
+    for (int i = 0; i < num_mirrors; i++)
+    {
+        mirror *mirror = mirrors[i];
+        pthread_mutex_lock(&mirror->mutex);
+        printf("status: %d: %s -> %s, %d directories watched, %llu events, %llu updates, backlog %d, "
+                "lag last %.3fs avg %.3fs max %.3fs\n",
+                i + 1, mirror->source, mirror->dest, mirror->num_watches, (unsigned long long)mirror->events,
+                (unsigned long long)mirror->updates, mirror->backlog, mirror->last_lag,
+                mirror->updates ? mirror->total_lag / mirror->updates : 0, mirror->max_lag);
+        pthread_mutex_unlock(&mirror->mutex);
+    }
+}
+
+int list_current_dir()
+{
+    TRACE_SPAN("list_current_dir");
+    // attempt to open .
+    DIR *current_dir = opendir(".");
+    if ( current_dir == 0 ) {
+        fprintf(stderr, "list: Unable to open directory .: %s\n", strerror(errno));
+        return 1;
+    }
+    errno = 0; // set errno to be zero because readdir returns zero both if it errors out or reaches the end of the directory. 
+    // readdir fails is errno is set to a nonzero value after the call
+    struct dirent *dir_info = readdir(current_dir);
+    if ( errno ) {
+        fprintf(stderr, "list: Unable to read directory .: %s\n", strerror(errno));
+        // attempt to close directory. if it fails, we quit because something is wrong
+        int close_err = closedir(current_dir);
+        if ( close_err == -1 ) {
+            fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
+            exit(1);
+        }
+        return 1;
+    }
+    printf("%s %13s\t\t%16s\n", "Type", "Filename", "Total Bytes"); // print header
+    while (dir_info) // loop while dir_info is not null and we haven't reached the last file entry
+    {
+        if (strcmp(dir_info->d_name, ".") && strcmp(dir_info->d_name, "..")) // skip the . and .. files
+        {
+            // stat files in directory to get file size
+            struct stat stat_buffer;
+            int stat_err = stat(dir_info->d_name, &stat_buffer);
+            if ( stat_err == -1 ) {
+                fprintf(stderr, "list: Unable to stat file %s: %s\n", dir_info->d_name, strerror(errno));
+                int close_err = closedir(current_dir);
+                if ( close_err == -1 ) {
+                    fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
+                    exit(1);
+                }
+                return 1;
+            }
+            // display executables in green
+            if ( (stat_buffer.st_mode & 0100) && (dir_info->d_type != 4) )
+            {
+                printf("\033[0;32mF: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
+            }
+            // display folders and files in red and yellow
+            else if (dir_info->d_type == 4)
+            {
+                printf("\033[0;31mD: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
+            }
+            else
+            {
+                printf("\033[0;33mF: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
+            }
+            
+        }
+        // try to see if the dir contains more files
+        errno = 0;
+        dir_info = readdir(current_dir); 
+        if ( errno ) {
+            fprintf(stderr, "list: Unable to read from directory .: %s\n", strerror(errno));
+            int close_err = closedir(current_dir);
+            if ( close_err == -1 ) {
+                fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
+                exit(1);
+            }
+            return 1;
+        }
+    }
+    // close the directory
+    int close_err = closedir(current_dir);
+    if ( close_err == -1 ) {
+        fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
+
+int change_dir(char *destination_path)
+{
+    // attempt to ask OS to change the directory
+    int chdir_err = chdir(destination_path);
+    if ( chdir_err < 0 ) {
+        fprintf(stderr, "chdir: unable to change current working directory to %s: %s\n", destination_path, strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
+
+int print_working_directory()
+{
+    // ask OS for the name of the current directory
+    char *curr_wd = NULL;
+    curr_wd = getcwd(curr_wd, 0); // passing in a null string and 0 has getcwd automatically allocate buffer of correct size
+    if (curr_wd == NULL) // check if malloc was successful
+    {
+        fprintf(stderr, "pwd: can not get current working directory: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", curr_wd);
+    free(curr_wd);
+    return 0;
+}
+
+// *** Program lookup cache
+
+// maps program names to the first executable with that name on PATH so start does not have to search PATH
+// on every exec. the server fills it once at startup and every session it forks inherits the warm table
+#define PATH_CACHE_SLOTS 16384 // must be a power of two
+
+typedef struct path_cache_entry
+{
+    char *name;
+    char *path;
+} path_cache_entry;
+
+path_cache_entry path_cache[PATH_CACHE_SLOTS];
+int path_cache_size;
+
+const char *path_cache_lookup(const char *name)
+{
+    if (!path_cache_size) { return NULL; }
+    for (uint32_t i = string_hash(name); ; i++)
+    {
+        path_cache_entry *entry = &path_cache[i & (PATH_CACHE_SLOTS - 1)];
+        if (entry->name == NULL) { return NULL; }
+        if (!strcmp(entry->name, name)) { return entry->path; }
+    }
+}
+
+// scan every directory on PATH, earlier directories win just like execvp
+void path_cache_load()
+{
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) { return; }
+    char *dirs = strdup(path_env);
+    if (dirs == NULL) { return; }
+    for (char *dir = strtok(dirs, ":"); dir != NULL; dir = strtok(NULL, ":"))
+    {
+        DIR *current_dir = opendir(dir);
+        if (current_dir == NULL) { continue; } // PATH often names directories that do not exist
+        struct dirent *dir_info;
+        while ((dir_info = readdir(current_dir)) != NULL && path_cache_size < PATH_CACHE_SLOTS * 3 / 4)
+        {
+            if (dir_info->d_name[0] == '.' || path_cache_lookup(dir_info->d_name)) { continue; }
+            char *full_path = join_path(dir, dir_info->d_name);
+            if (full_path == NULL || access(full_path, X_OK))
+            {
+                free(full_path);
+                continue;
+            }
+            uint32_t i = string_hash(dir_info->d_name);
+            while (path_cache[i & (PATH_CACHE_SLOTS - 1)].name != NULL) { i++; }
+            path_cache[i & (PATH_CACHE_SLOTS - 1)] = (path_cache_entry){strdup(dir_info->d_name), full_path};
+            path_cache_size++;
+        }
+        closedir(current_dir);
+    }
+    free(dirs);
+}
+
+int start_process(char *words[128])
+{
+    TRACE_SPAN("start_process");
+    pid_t pid = fork();
+    if (pid < 0) 
+    {
+        fprintf(stderr, "myshell: unable to fork: %s\n", strerror(errno));
+        exit(1);
+    }
+    else if (pid == 0) // child process
+    {
+        const char *cached_path = strchr(words[1], '/') ? NULL : path_cache_lookup(words[1]);
+        if (cached_path != NULL) { execv(cached_path, &words[1]); } // fall back to a PATH search if the entry is stale
+        execvp(words[1], &words[1]);
+        // if we reach this point, exec failed
+        fprintf(stderr, "myshell: unable to execute %s: %s\n", words[0], strerror(errno));
+        exit(1);
+    }
+    else // parent process
+    {
+        printf("myshell: process %d started\n", pid);
+        return pid;
+    }
+}
+// wait for any child to finish
+int wait_for_process()
+{
+    TRACE_SPAN("wait_for_process");
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) // if we get -1, either there is no children (ECHILD errno) or we got a fatal error
+    {
+        if (errno == ECHILD)
+        {
+            printf("myshell: No children.\n");
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "myshell: unable to wait for any child: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    else if (WIFEXITED(status)) // normal exit - display exit status
+    {
+        printf("myshell: process %d exited normally with status %d.\n", pid, WEXITSTATUS(status));
+        return 0;
+    } 
+    else if (WIFSIGNALED(status)) // abnormal exit - display signal that caused termination
+    {
+        printf("myshell: process %d exited abnormally with signal %d: %s\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        return 0;
+    } 
+    else
+    {
+        printf("myshell: process %d exited in unknown state\n", pid);
+        return 1;
+    }
+}
+// wait for specified child to finish: basically the same function as above but different system call and different error messages
+int wait_for_specific_process(pid_t child_pid)
+{
+    TRACE_SPAN("wait_for_specific_process");
+    int status;
+    pid_t pid = waitpid(child_pid, &status, 0);
+    if (pid < 0)
+    {
+        if (errno == ECHILD)
+        {
+            printf("myshell: no child with such PID.\n");
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "myshell: unable to wait for child with PID %d: %s\n", child_pid, strerror(errno));
+            exit(1);
+        }
+    }
+    else if (WIFEXITED(status)) 
+    {
+        printf("myshell: process %d exited normally with status %d.\n", pid, WEXITSTATUS(status));
+        return 0;
+    } 
+    else if (WIFSIGNALED(status)) 
+    {
+        printf("myshell: process %d exited abnormally with signal %d: %s\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        return 0;
+    } 
+    else
+    {
+        printf("myshell: process %d exited in unknown state\n", pid);
+        return 1;
+    }
+}
+
+int kill_process(pid_t pid)
+{
+    //send SIGKILL to process
+    int kill_ret = kill(pid, 15);
+    if (kill_ret < 0)
+    {
+        fprintf(stderr, "kill: unable to kill process %d: %s\n", pid, strerror(errno));
+        return 1;
+    }
+    printf("kill: successfully able to kill process with PID %d\n", pid);
+    return 0;
+}
+
+// *** Glob expansion
+
+// arguments containing * ? or [...] are replaced by the sorted paths they match, like sh does. each path component
+// is compiled once into tokens and matched against the names from a single readdir of its directory: the literal
+// prefix is compared first so most names are rejected with one memcmp, and a * followed by a literal jumps between
+// occurrences of the literal's first character with memchr instead of trying every position.
+// a \ makes the next character literal, and an argument that matches nothing is left as it is
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1 // ?
+#define GLOB_STAR 2
+#define GLOB_CLASS 3
+
+typedef struct glob_token
+{
+    int type;
+    const char *literal; // GLOB_LITERAL, points into glob_matcher.literals
+    size_t len;
+    uint8_t set[32]; // GLOB_CLASS, one bit per byte value
+} glob_token;
+
+typedef struct glob_matcher
+{
+    glob_token tokens[64];
+    int num_tokens;
+    size_t prefix_len; // length of the leading literal token, 0 if the component starts with a wildcard
+    size_t min_len; // no shorter name can match
+    int match_dot; // names starting with . only match a pattern that starts with one
+    char literals[256];
+} glob_matcher;
+
+// storage for the expanded arguments of the current command, freed when the next one is expanded
+char **glob_storage;
+int glob_storage_len;
+int glob_storage_capacity;
+
+int glob_has_wildcard(const char *pattern, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (pattern[i] == '\\' && i + 1 < len) { i++; }
+        else if (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '[') { return 1; }
+    }
+    return 0;
+}
+
+// compiles one path component of len bytes. returns -1 if it is too long to compile
+int glob_compile(glob_matcher *matcher, const char *pattern, size_t len)
+{
+    memset(matcher, 0, sizeof(*matcher));
+    // the first character decides, escaped or not: \.foo is still a literal leading dot
+    size_t first = len > 1 && pattern[0] == '\\' ? 1 : 0;
+    matcher->match_dot = len > 0 && pattern[first] == '.';
+    size_t used = 0;
+    size_t i = 0;
+    while (i < len)
+    {
+        if (matcher->num_tokens == 64) { return -1; }
+        glob_token *token = &matcher->tokens[matcher->num_tokens];
+        if (pattern[i] == '*')
+        {
+            while (i < len && pattern[i] == '*') { i++; } // ** is the same as *
+            token->type = GLOB_STAR;
+            matcher->num_tokens++;
+            continue;
+        }
+        if (pattern[i] == '?')
+        {
+            token->type = GLOB_ANY;
+            matcher->min_len++;
+            matcher->num_tokens++;
+            i++;
+            continue;
+        }
+        if (pattern[i] == '[') // a class runs to the next ] that is not its first character
+        {
+            size_t end = i + 1;
+            if (end < len && (pattern[end] == '!' || pattern[end] == '^')) { end++; }
+            if (end < len && pattern[end] == ']') { end++; }
+            while (end < len && pattern[end] != ']') { end++; }
+            if (end < len)
+            {
+                size_t j = i + 1;
+                int negate = pattern[j] == '!' || pattern[j] == '^';
+                if (negate) { j++; }
+                uint8_t set[32] = {0};
+                for (; j < end; j++)
+                {
+                    unsigned char low = pattern[j];
+                    unsigned char high = low;
+                    if (j + 2 < end && pattern[j + 1] == '-')
+                    {
+                        high = pattern[j + 2];
+                        j += 2;
+                    }
+                    for (unsigned c = low; c <= high; c++) { set[c / 8] |= 1 << (c % 8); }
+                }
+                token->type = GLOB_CLASS;
+                for (int k = 0; k < 32; k++) { token->set[k] = negate ? ~set[k] : set[k]; }
+                matcher->min_len++;
+                matcher->num_tokens++;
+                i = end + 1;
+                continue;
+            }
+            // an unterminated [ is an ordinary character
+        }
+        // a run of literal characters, with \ escapes removed
+        token->type = GLOB_LITERAL;
+        token->literal = matcher->literals + used;
+        while (i < len && pattern[i] != '*' && pattern[i] != '?' && (pattern[i] != '[' || token->len == 0))
+        {
+            if (pattern[i] == '\\' && i + 1 < len) { i++; }
+            if (used == sizeof(matcher->literals)) { return -1; }
+            matcher->literals[used++] = pattern[i++];
+            token->len++;
+        }
+        matcher->min_len += token->len;
+        if (matcher->num_tokens == 0) { matcher->prefix_len = token->len; }
+        matcher->num_tokens++;
+    }
+    return 0;
+}
+
+int glob_match(const glob_matcher *matcher, const char *name, size_t len)
+{
+    if (len < matcher->min_len) { return 0; }
+    if (name[0] == '.' && !matcher->match_dot) { return 0; }
+    if (matcher->prefix_len && memcmp(name, matcher->tokens[0].literal, matcher->prefix_len)) { return 0; }
+    int t = matcher->prefix_len ? 1 : 0;
+    size_t pos = matcher->prefix_len;
+    int star_t = -1; // token after the last *, which is where matching restarts when something fails
+    size_t star_pos = 0;
+    while (1)
+    {
+        if (t == matcher->num_tokens)
+        {
+            if (pos == len || star_t == matcher->num_tokens) { return 1; } // a trailing * takes the rest
+        }
+        else
+        {
+            const glob_token *token = &matcher->tokens[t];
+            if (token->type == GLOB_STAR)
+            {
+                star_t = ++t;
+                star_pos = pos;
+                continue;
+            }
+            if (token->type == GLOB_LITERAL)
+            {
+                if (t == star_t) // skip straight to the next place the literal could start
+                {
+                    const char *found = memchr(name + pos, token->literal[0], len - pos);
+                    if (found == NULL) { return 0; }
+                    pos = star_pos = found - name;
+                }
+                if (len - pos >= token->len && !memcmp(name + pos, token->literal, token->len))
+                {
+                    pos += token->len;
+                    t++;
+                    continue;
                 }
             }
-            current_bytes_written += write_ret;
+            else if (pos < len && (token->type == GLOB_ANY ||
+                                   token->set[(unsigned char)name[pos] / 8] & (1 << ((unsigned char)name[pos] % 8))))
+            {
+                pos++;
+                t++;
+                continue;
+            }
         }
-        total_bytes_written += current_bytes_written;
+        // no match here, let the last * take one more character
+        if (star_t < 0 || star_pos >= len) { return 0; }
+        t = star_t;
+        pos = ++star_pos;
     }
+}
 
-    // output when a successful copy occurs
-    printf("%s -> %s\n", source, dest);
-
-    // close source file
-    int close_err = close(input_fd); // if we can't close a file something is seriously wrong
-    if ( close_err < 0 ) {
-        fprintf(stderr, "copy: Unable to close file %s: %s\n", source, strerror(errno));
-	    close_err = close(dest_fd);
-        if ( close_err < 0 ) {
-            fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
+void glob_store(char *path)
+{
+    if (glob_storage_len == glob_storage_capacity)
+    {
+        glob_storage_capacity = glob_storage_capacity ? glob_storage_capacity * 2 : 64;
+        glob_storage = realloc(glob_storage, glob_storage_capacity * sizeof(char *));
+        if (glob_storage == NULL)
+        {
+            fprintf(stderr, "myshell: Unable to allocate memory: exiting program\n");
             exit(1);
         }
-        exit(1);
     }
+    glob_storage[glob_storage_len++] = path;
+}
 
-    // close destination file
-    close_err = close(dest_fd);
-    if ( close_err < 0 ) {
-        fprintf(stderr, "copy: Unable to close file %s: %s\n", dest, strerror(errno));
-	    exit(1);
-    }
-    // update info about files copied
-    copy_info->num_bytes += total_bytes_written;
-    copy_info->num_files++;
-    return 0;
+int glob_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-// takes in a directory path and then recursively calls itself for every directory in that directory
-// also copies all the files in the directory
-// same as filecopy above, if we get a system call error, attempt to free as many resources and return
-// if there is an error freeing resources, something is seriously wrong and we quit
-int recursive_directory_copy(const char *dirname, const char *destname, copy_info *copy_info)
+// adds every path matching rest below base, which is empty or ends in /, to glob_storage
+void glob_expand_path(const char *base, const char *rest)
 {
-    // attempt to open directory
-    DIR *current_dir = opendir(dirname);
-    if ( current_dir == 0 ) {
-        fprintf(stderr, "copy: Unable to open directory %s: %s\n", dirname, strerror(errno));
-        return 1;
-    }
-    // check for file permissions 
-    struct stat stat_buffer;
-    int stat_err = stat(dirname, &stat_buffer);
-    if ( stat_err == -1 ) {
-        fprintf(stderr, "copy: Unable to stat directory %s: %s\n", dirname, strerror(errno));
-        int close_err = closedir(current_dir);
-        if ( close_err == -1 ) {
-            fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
+    const char *slash = strchr(rest, '/');
+    size_t component_len = slash ? (size_t)(slash - rest) : strlen(rest);
+    size_t base_len = strlen(base);
+    if (!glob_has_wildcard(rest, component_len)) // a literal component only has to exist
+    {
+        char *path = malloc(base_len + component_len + 2);
+        if (path == NULL)
+        {
+            fprintf(stderr, "myshell: Unable to allocate memory: exiting program\n");
             exit(1);
         }
-        return 1;
+        memcpy(path, base, base_len);
+        size_t path_len = base_len;
+        for (size_t i = 0; i < component_len; i++) // remove \ escapes
+        {
+            if (rest[i] == '\\' && i + 1 < component_len) { i++; }
+            path[path_len++] = rest[i];
+        }
+        path[path_len] = '\0';
+        struct stat stat_buffer;
+        if (slash == NULL)
+        {
+            if (lstat(path, &stat_buffer) == 0) { glob_store(path); }
+            else { free(path); }
+            return;
+        }
+        path[path_len] = '/';
+        path[path_len + 1] = '\0';
+        glob_expand_path(path, slash + 1);
+        free(path);
+        return;
     }
-    // create new directory with same permissions
-    int mkdir_err = mkdir(destname, stat_buffer.st_mode);
-    if (mkdir_err < 0)
+    glob_matcher matcher;
+    if (glob_compile(&matcher, rest, component_len)) { return; }
+    DIR *dir = opendir(base_len ? base : ".");
+    if (dir == NULL) { return; }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        fprintf(stderr, "copy: Unable to create directory %s: %s\n", destname, strerror(errno));
-        int close_err = closedir(current_dir);
-        if ( close_err == -1 ) {
-            fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
+        size_t name_len = strlen(entry->d_name);
+        if (!glob_match(&matcher, entry->d_name, name_len)) { continue; }
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) { continue; }
+        char *path = malloc(base_len + name_len + 2);
+        if (path == NULL)
+        {
+            fprintf(stderr, "myshell: Unable to allocate memory: exiting program\n");
             exit(1);
         }
-        return 1;
-    }
-    // display successful copy
-    printf("%s -> %s\n", dirname, destname);
-    copy_info->num_dir++;
-    errno = 0; // set errno to be zero because readdir returns zero both if it errors out or reaches the end of the directory. 
-    // readdir fails is errno is set to a nonzero value after the call
-    struct dirent *dir_info = readdir(current_dir);
-    if ( errno ) {
-        fprintf(stderr, "copy: Unable to read directory %s: %s\n", dirname, strerror(errno));
-        int close_err = closedir(current_dir);
-        if ( close_err == -1 ) {
-            fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-            exit(1);
+        memcpy(path, base, base_len);
+        memcpy(path + base_len, entry->d_name, name_len + 1);
+        if (slash == NULL)
+        {
+            glob_store(path);
+            continue;
         }
-        return 1;
+        // more components follow, so only directories can lead to matches
+        struct stat stat_buffer;
+        int is_dir = entry->d_type == DT_DIR ||
+                     ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) && stat(path, &stat_buffer) == 0 &&
+                      S_ISDIR(stat_buffer.st_mode));
+        if (is_dir)
+        {
+            strcat(path, "/");
+            glob_expand_path(path, slash + 1);
+        }
+        free(path);
     }
-    while (dir_info) // loop while dir_info is not null and we haven't reached the last file entry
+    closedir(dir);
+}
+
+// removes the \ from \* \? \[ and \\ in place, for arguments that are passed on without expanding
+void glob_unescape(char *word)
+{
+    char *out = word;
+    for (char *in = word; *in; in++)
     {
-        if (strcmp(dir_info->d_name, ".") && strcmp(dir_info->d_name, "..")) // skip the . and .. files
+        if (in[0] == '\\' && (in[1] == '*' || in[1] == '?' || in[1] == '[' || in[1] == '\\')) { in++; }
+        *out++ = *in;
+    }
+    *out = '\0';
+}
+
+// replaces the arguments after words[0] that contain wildcards with what they match.
+// returns 1 if the expansion does not fit in words
+int glob_expand_words(char *words[129], int *nwords)
+{
+    for (int i = 0; i < glob_storage_len; i++) { free(glob_storage[i]); }
+    glob_storage_len = 0;
+    char *expanded[129];
+    int nexpanded = 0;
+    for (int i = 0; i < *nwords; i++)
+    {
+        int first = glob_storage_len;
+        if (i > 0 && glob_has_wildcard(words[i], strlen(words[i])))
         {
-            // create the current and new paths
-            char *current_path = malloc(strlen(dirname) + strlen(dir_info->d_name) + 2);
-            if (current_path == NULL)
-            {
-                fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
-                int close_err = closedir(current_dir);
-                if ( close_err == -1 ) {
-                    fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                    exit(1);
-                }
-                return 1;
-            }
-            char *copy_to = malloc(strlen(destname) + strlen(dir_info->d_name) + 2);
-            if (copy_to == NULL)
-            {
-                fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
-                if (current_path != NULL) {free(current_path);}
-                int close_err = closedir(current_dir);
-                if ( close_err == -1 ) {
-                    fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                    exit(1);
-                }
-                return 1;
-            }
-            sprintf(current_path, "%s/%s", dirname, dir_info->d_name);
-            sprintf(copy_to, "%s/%s", destname, dir_info->d_name);
-            if (dir_info->d_type == 4) // if the file in the directory is another directory, recursively copy from there
-            {
-                int dir_copy_ret = recursive_directory_copy(current_path, copy_to, copy_info);
-                if (dir_copy_ret)
-                {
-                    int close_err = closedir(current_dir);
-                    if ( close_err == -1 ) {
-                        fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                        exit(1);
-                    }
-                    if (current_path != NULL) {free(current_path);}
-                    if (copy_to != NULL) {free(copy_to);}
-                    return 1;
-                }
-            }
-            else if (dir_info->d_type == 8) // else if its a regular file, preform filecopy on it
-            {
-                int file_copy_ret = filecopy(current_path, copy_to, copy_info);
-                if (file_copy_ret)
-                {
-                    int close_err = closedir(current_dir);
-                    if ( close_err == -1 ) {
-                        fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                        exit(1);
-                    }
-                    if (current_path != NULL) {free(current_path);}
-                    if (copy_to != NULL) {free(copy_to);}
-                    return 1;
-                }
-            }
-            else // other file types should exit
-            {
-                fprintf(stderr, "copy: Unable to copy file %s: file is not a regular file or directory\n", current_path);
-                int close_err = closedir(current_dir);
-                if ( close_err == -1 ) {
-                    fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                    exit(1);
-                }
-                if (current_path != NULL) {free(current_path);}
-                if (copy_to != NULL) {free(copy_to);}
-                return 1;
-            }
-            if (current_path != NULL) {free(current_path);}
-            if (copy_to != NULL) {free(copy_to);}
+            if (words[i][0] == '/') { glob_expand_path("/", words[i] + 1); }
+            else { glob_expand_path("", words[i]); }
         }
-        // try to see if the dir contains more files
-        errno = 0;
-        dir_info = readdir(current_dir); 
-        if ( errno ) {
-            fprintf(stderr, "copy: Unable to read from directory %s: %s\n", dirname, strerror(errno));
-            int close_err = closedir(current_dir);
-            if ( close_err == -1 ) {
-                fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-                exit(1);
-            }
+        int count = glob_storage_len > first ? glob_storage_len - first : 1;
+        if (nexpanded + count > 128)
+        {
+            fprintf(stderr, "Error: too many arguments after expanding wildcards. Only accepting 128 arguments\n");
             return 1;
         }
+        if (glob_storage_len == first) // no wildcards, or nothing matched
+        {
+            if (i > 0) { glob_unescape(words[i]); }
+            expanded[nexpanded++] = words[i];
+            continue;
+        }
+        qsort(glob_storage + first, count, sizeof(char *), glob_compare);
+        memcpy(expanded + nexpanded, glob_storage + first, count * sizeof(char *));
+        nexpanded += count;
     }
-    // close the directory
-    int close_err = closedir(current_dir);
-    if ( close_err == -1 ) {
-        fprintf(stderr, "copy: Unable to close directory %s: %s\n", dirname, strerror(errno));
-        exit(1);
-    }
+    memcpy(words, expanded, nexpanded * sizeof(char *));
+    words[nexpanded] = NULL;
+    *nwords = nexpanded;
     return 0;
 }
-int treecopy(char *source_file, char *dest_file)
+
+// *** History
+
+// every command is appended to ~/.myshell_history, a fixed size file that all running shells mmap and share
+// a shell claims the next entry number with an atomic add on the shared header and writes entry number % capacity,
+// so the file is a ring holding the last HISTORY_ENTRIES commands. next to the entries is a table with the first
+// 8 bytes of each command packed into an integer, which is all a prefix lookup has to scan
+// opening the file is one open and one mmap however much history there is
+#define HISTORY_MAGIC 0x3174736968796d00ull // "\0myhist1"
+#define HISTORY_ENTRIES 4096
+#define HISTORY_TEXT 1024
+
+typedef struct history_header
 {
-    copy_info copy_info = {0, 0, 0}; // struct used to store info on how much data was copied
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t last; // number of the newest entry, entries are numbered from 1
+    uint64_t reserved[5];
+} history_header;
 
-    // read input to see if its a dir or a file or other
+typedef struct history_entry
+{
+    uint64_t number; // 0 while the entry is being written
+    char text[HISTORY_TEXT];
+} history_entry;
+
+typedef struct history_file
+{
+    history_header header;
+    uint64_t prefixes[HISTORY_ENTRIES];
+    history_entry entries[HISTORY_ENTRIES];
+} history_file;
+
+history_file *history;
+int history_failed;
+
+// the first 8 bytes of a command as a big endian integer, so a prefix compare is a mask and a compare
+uint64_t history_prefix_key(const char *text, size_t len)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < 8; i++) { key = (key << 8) | (i < len ? (unsigned char)text[i] : 0); }
+    return key;
+}
+
+int history_open()
+{
+    if (history != NULL) { return 0; }
+    if (history_failed) { return 1; }
+    history_failed = 1; // only complain once
+    const char *home = getenv("HOME");
+    if (home == NULL) { return 1; }
+    char *path = join_path(home, ".myshell_history");
+    if (path == NULL) { return 1; }
+    int history_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if (history_fd < 0)
+    {
+        fprintf(stderr, "myshell: Unable to open history file %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
     struct stat stat_buffer;
-    int stat_err = stat(source_file, &stat_buffer);
-    if ( stat_err == -1 ) {
-        fprintf(stderr, "copy: Unable to stat file %s: %s\n", source_file, strerror(errno));
+    if (fstat(history_fd, &stat_buffer) == -1 ||
+        ((size_t)stat_buffer.st_size < sizeof(history_file) && ftruncate(history_fd, sizeof(history_file)) < 0))
+    {
+        fprintf(stderr, "myshell: Unable to size history file %s: %s\n", path, strerror(errno));
+        close(history_fd);
+        free(path);
         return 1;
     }
-    if (!S_ISDIR(stat_buffer.st_mode)) // if its only a file just copy it
+    history_file *map = mmap(NULL, sizeof(history_file), PROT_READ|PROT_WRITE, MAP_SHARED, history_fd, 0);
+    close(history_fd);
+    if (map == MAP_FAILED)
     {
-        if (filecopy(source_file, dest_file, &copy_info)) {return 0;}
+        fprintf(stderr, "myshell: Unable to map history file %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
     }
-    else //otherwise its a directory
+    // a new file is all zeroes, whichever shell gets here first stamps it. every shell sets the capacity before it
+    // tries the magic, so a shell that sees the magic also sees the capacity
+    uint64_t capacity = 0;
+    __atomic_compare_exchange_n(&map->header.capacity, &capacity, HISTORY_ENTRIES, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    uint64_t magic = 0;
+    __atomic_compare_exchange_n(&map->header.magic, &magic, HISTORY_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if ((magic != 0 && magic != HISTORY_MAGIC) || __atomic_load_n(&map->header.capacity, __ATOMIC_ACQUIRE) != HISTORY_ENTRIES)
     {
-        if (source_file[strlen(source_file) - 1] == '/') // remove trailing / if it exists
-        {
-            char *dir_source = malloc(strlen(source_file) + 1); // allocate memory for string with trailing / removed
-            if (dir_source == NULL)
-            {
-                fprintf(stderr, "copy: Unable to allocate memory: exiting program\n");
-                exit(1);
-            }
-            strcpy(dir_source, source_file);
-            dir_source[strlen(source_file) - 1] = '\0'; // remove /
-            int copy_ret = recursive_directory_copy(dir_source, dest_file, &copy_info); // begin recursively copying the directory with removing trailing /
-            if (dir_source != NULL) {free(dir_source);}
-            if (copy_ret){return 1;} // recursivly bubble up error returns
-        }
-        else
-        {
-            int copy_ret = recursive_directory_copy(source_file, dest_file, &copy_info); // begin recursively copying the directory without having to change argv
-            if (copy_ret){return 1;}
-        } 
+        fprintf(stderr, "myshell: %s is not a history file this shell can use\n", path);
+        munmap(map, sizeof(history_file));
+        free(path);
+        return 1;
     }
-    printf("copy: copied %d directories, %d files, and %d bytes from %s to %s\n",
-            copy_info.num_dir, copy_info.num_files, copy_info.num_bytes, source_file, dest_file);
+    free(path);
+    history = map;
+    history_failed = 0;
     return 0;
 }
 
-// *** End Code taken from treecopy.c 
+void history_add(const char *line)
+{
+    size_t len = strcspn(line, "\n");
+    if (!len || len >= HISTORY_TEXT || history_open()) { return; }
+    uint64_t number = __atomic_add_fetch(&history->header.last, 1, __ATOMIC_ACQ_REL);
+    uint64_t slot = number % HISTORY_ENTRIES;
+    history_entry *entry = &history->entries[slot];
+    __atomic_store_n(&entry->number, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(entry->text, line, len);
+    entry->text[len] = '\0';
+    __atomic_store_n(&history->prefixes[slot], history_prefix_key(line, len), __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->number, number, __ATOMIC_RELEASE);
+}
 
-int list_current_dir()
+// copy entry number into text. returns 0 on success and 1 if it is not in the ring (any more)
+int history_get(uint64_t number, char *text)
 {
-    // attempt to open .
-    DIR *current_dir = opendir(".");
-    if ( current_dir == 0 ) {
-        fprintf(stderr, "list: Unable to open directory .: %s\n", strerror(errno));
+    if (history_open() || number == 0) { return 1; }
+    history_entry *entry = &history->entries[number % HISTORY_ENTRIES];
+    if (__atomic_load_n(&entry->number, __ATOMIC_ACQUIRE) != number) { return 1; }
+    memcpy(text, entry->text, HISTORY_TEXT);
+    text[HISTORY_TEXT - 1] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&entry->number, __ATOMIC_RELAXED) != number; // another shell reused the entry meanwhile
+}
+
+uint64_t history_last()
+{
+    if (history_open()) { return 0; }
+    return __atomic_load_n(&history->header.last, __ATOMIC_ACQUIRE);
+}
+
+// the history builtin: print the entries that start with prefix, oldest first
+void history_print(const char *prefix)
+{
+    uint64_t last = history_last();
+    if (!last) { return; }
+    size_t prefix_len = strlen(prefix);
+    uint64_t key = history_prefix_key(prefix, prefix_len);
+    uint64_t mask = prefix_len >= 8 ? ~0ull : ~(~0ull >> (8 * prefix_len));
+    uint64_t first = last > HISTORY_ENTRIES ? last - HISTORY_ENTRIES + 1 : 1;
+    char text[HISTORY_TEXT];
+    for (uint64_t number = first; number <= last; number++)
+    {
+        uint64_t prefix_key = __atomic_load_n(&history->prefixes[number % HISTORY_ENTRIES], __ATOMIC_RELAXED);
+        if ((prefix_key & mask) != (key & mask)) { continue; }
+        if (history_get(number, text) || strncmp(text, prefix, prefix_len)) { continue; }
+        printf("%5llu  %s\n", (unsigned long long)number, text);
+    }
+}
+
+// *** Server mode
+
+// myshell --serve SOCKET listens on a unix domain socket and forks a session for every connection
+// a session is the normal shell loop with the connection as its stdin, stdout and stderr, so each one has its own
+// working directory while sharing everything the server loaded before the fork
+#define PROMPT "\033[0;32mmyshell>\033[0;0m "
+
+void shell_loop();
+
+int serve(const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "myshell: socket path %s is too long\n", socket_path);
         return 1;
     }
-    errno = 0; // set errno to be zero because readdir returns zero both if it errors out or reaches the end of the directory. 
-    // readdir fails is errno is set to a nonzero value after the call
-    struct dirent *dir_info = readdir(current_dir);
-    if ( errno ) {
-        fprintf(stderr, "list: Unable to read directory .: %s\n", strerror(errno));
-        // attempt to close directory. if it fails, we quit because something is wrong
-        int close_err = closedir(current_dir);
-        if ( close_err == -1 ) {
-            fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
-            exit(1);
+    strcpy(address.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        fprintf(stderr, "myshell: unable to create socket: %s\n", strerror(errno));
+        return 1;
+    }
+    struct stat stat_buffer;
+    if (lstat(socket_path, &stat_buffer) == 0) // a socket left behind by an earlier server would stop bind
+    {
+        if (!S_ISSOCK(stat_buffer.st_mode))
+        {
+            fprintf(stderr, "myshell: unable to listen on %s: file exists and is not a socket\n", socket_path);
+            close(listen_fd);
+            return 1;
         }
+        // only a socket nothing is listening on any more is stale, a live server keeps its path
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        int connect_ret = probe_fd < 0 ? -1 : connect(probe_fd, (struct sockaddr *)&address, sizeof(address));
+        int connect_errno = errno;
+        if (probe_fd >= 0) { close(probe_fd); }
+        if (connect_ret == 0 || connect_errno != ECONNREFUSED)
+        {
+            if (connect_ret == 0) { fprintf(stderr, "myshell: unable to listen on %s: already serving\n", socket_path); }
+            else { fprintf(stderr, "myshell: unable to listen on %s: %s\n", socket_path, strerror(connect_errno)); }
+            close(listen_fd);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    // anyone who can connect runs commands as this user, so only the owner gets to
+    mode_t old_umask = umask(0077);
+    int bind_ret = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (bind_ret < 0 || chmod(socket_path, 0600) < 0 || listen(listen_fd, 64) < 0)
+    {
+        fprintf(stderr, "myshell: unable to listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
         return 1;
     }
-    printf("%s %13s\t\t%16s\n", "Type", "Filename", "Total Bytes"); // print header
-    while (dir_info) // loop while dir_info is not null and we haven't reached the last file entry
+    path_cache_load();
+    printf("myshell: serving on %s (%d programs cached)\n", socket_path, path_cache_size);
+    fflush(stdout);
+    while (1)
     {
-        if (strcmp(dir_info->d_name, ".") && strcmp(dir_info->d_name, "..")) // skip the . and .. files
+        int session_fd = accept(listen_fd, NULL, NULL);
+        while (waitpid(-1, NULL, WNOHANG) > 0) {} // reap sessions that have finished
+        if (session_fd < 0)
         {
-            // stat files in directory to get file size
-            struct stat stat_buffer;
-            int stat_err = stat(dir_info->d_name, &stat_buffer);
-            if ( stat_err == -1 ) {
-                fprintf(stderr, "list: Unable to stat file %s: %s\n", dir_info->d_name, strerror(errno));
-                int close_err = closedir(current_dir);
-                if ( close_err == -1 ) {
-                    fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
-                    exit(1);
-                }
-                return 1;
-            }
-            // display executables in green
-            if ( (stat_buffer.st_mode & 0100) && (dir_info->d_type != 4) )
-            {
-                printf("\033[0;32mF: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
-            }
-            // display folders and files in red and yellow
-            else if (dir_info->d_type == 4)
-            {
-                printf("\033[0;31mD: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
-            }
-            else
-            {
-                printf("\033[0;33mF: %15s\033[0m \t\t%10ld bytes\n", dir_info->d_name, stat_buffer.st_size);
-            }
-            
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            fprintf(stderr, "myshell: unable to accept connection: %s\n", strerror(errno));
+            close(listen_fd);
+            return 1;
         }
-        // try to see if the dir contains more files
-        errno = 0;
-        dir_info = readdir(current_dir); 
-        if ( errno ) {
-            fprintf(stderr, "list: Unable to read from directory .: %s\n", strerror(errno));
-            int close_err = closedir(current_dir);
-            if ( close_err == -1 ) {
-                fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "myshell: unable to fork: %s\n", strerror(errno));
+        }
+        else if (pid == 0) // session
+        {
+            close(listen_fd);
+            if (dup2(session_fd, STDIN_FILENO) < 0 || dup2(session_fd, STDOUT_FILENO) < 0 || dup2(session_fd, STDERR_FILENO) < 0)
+            {
                 exit(1);
             }
-            return 1;
+            close(session_fd);
+            setvbuf(stdout, NULL, _IOLBF, 0); // behave like a terminal so output lines come out in order
+            shell_loop();
+            exit(0);
         }
+        close(session_fd);
     }
-    // close the directory
-    int close_err = closedir(current_dir);
-    if ( close_err == -1 ) {
-        fprintf(stderr, "list: Unable to close directory .: %s\n", strerror(errno));
-        exit(1);
-    }
-    return 0;
 }
 
-int change_dir(char *destination_path)
+int client_connect(const char *socket_path)
 {
-    // attempt to ask OS to change the directory
-    int chdir_err = chdir(destination_path);
-    if ( chdir_err < 0 ) {
-        fprintf(stderr, "chdir: unable to change current working directory to %s: %s\n", destination_path, strerror(errno));
-        exit(1);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "myshell: unable to connect to %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) { close(fd); }
+        return -1;
     }
-    return 0;
+    return fd;
 }
 
-int print_working_directory()
+// myshell --client SOCKET: pass stdin to a session and everything it prints back to stdout
+int client(const char *socket_path)
 {
-    // ask OS for the name of the current directory
-    char *curr_wd = NULL;
-    curr_wd = getcwd(curr_wd, 0); // passing in a null string and 0 has getcwd automatically allocate buffer of correct size
-    if (curr_wd == NULL) // check if malloc was successful
+    int fd = client_connect(socket_path);
+    if (fd < 0) { return 1; }
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    char buffer[65536];
+    while (1)
     {
-        fprintf(stderr, "pwd: can not get current working directory: %s\n", strerror(errno));
-        return 1;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR) { continue; }
+            fprintf(stderr, "myshell: unable to poll: %s\n", strerror(errno));
+            return 1;
+        }
+        if (fds[0].revents)
+        {
+            ssize_t read_ret = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (read_ret <= 0) // no more commands, let the session finish what it is doing
+            {
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            }
+            else if (write_all(fd, buffer, read_ret) < 0) { break; }
+        }
+        if (fds[1].revents)
+        {
+            ssize_t read_ret = read(fd, buffer, sizeof(buffer));
+            if (read_ret <= 0) break;
+            if (write_all(STDOUT_FILENO, buffer, read_ret) < 0) { break; }
+        }
     }
-    printf("%s\n", curr_wd);
-    free(curr_wd);
+    close(fd);
     return 0;
 }
 
-int start_process(char *words[128])
+// read from a session until the next prompt shows up, which means the last command is finished
+int client_wait_prompt(int fd)
 {
-    pid_t pid = fork();
-    if (pid < 0) 
-    {
-        fprintf(stderr, "myshell: unable to fork: %s\n", strerror(errno));
-        exit(1);
-    }
-    else if (pid == 0) // child process
+    char buffer[4096];
+    size_t prompt_len = strlen(PROMPT);
+    char tail[64] = {0};
+    size_t tail_len = 0;
+    while (1)
     {
-        execvp(words[1], &words[1]);
-        // if we reach this point, exec failed
-        fprintf(stderr, "myshell: unable to execute %s: %s\n", words[0], strerror(errno));
-        exit(1);
+        ssize_t read_ret = read(fd, buffer, sizeof(buffer));
+        if (read_ret < 0 && errno == EINTR) { continue; }
+        if (read_ret <= 0) { return 1; }
+        // keep the last bytes seen so a prompt split across reads is still found
+        for (ssize_t i = 0; i < read_ret; i++)
+        {
+            if (tail_len == prompt_len) { memmove(tail, tail + 1, --tail_len); }
+            tail[tail_len++] = buffer[i];
+        }
+        if (tail_len == prompt_len && !memcmp(tail, PROMPT, prompt_len)) { return 0; }
     }
-    else // parent process
+}
+
+// myshell --client SOCKET --bench N COMMAND...: run COMMAND N times in one session and then N times in a freshly
+// started myshell each, and compare the average latency
+// sends command to a session count times, adding the seconds it took to elapsed if that is not NULL
+int bench_commands(int fd, const char *command, int count, double *elapsed)
+{
+    double start = monotonic_seconds();
+    for (int i = 0; i < count; i++)
     {
-        printf("myshell: process %d started\n", pid);
-        return pid;
+        if (write_all(fd, command, strlen(command)) < 0 || client_wait_prompt(fd)) { return 1; }
     }
+    if (elapsed != NULL) { *elapsed += monotonic_seconds() - start; }
+    return 0;
 }
-// wait for any child to finish
-int wait_for_process()
+
+// baseline_path is an optional second server built with make myshell-notrace, to compare against spans compiled out
+int client_bench(const char *socket_path, const char *baseline_path, int runs, char **command_words, int num_words)
 {
-    int status;
-    pid_t pid = wait(&status);
-    if (pid < 0) // if we get -1, either there is no children (ECHILD errno) or we got a fatal error
+    char command[1024] = "";
+    for (int i = 0; i < num_words; i++)
     {
-        if (errno == ECHILD)
-        {
-            printf("myshell: No children.\n");
-            return 0;
-        }
-        else
+        if (strlen(command) + strlen(command_words[i]) + 2 >= sizeof(command))
         {
-            fprintf(stderr, "myshell: unable to wait for any child: %s\n", strerror(errno));
-            exit(1);
+            fprintf(stderr, "myshell: benchmark command is too long\n");
+            return 1;
         }
+        if (i) { strcat(command, " "); }
+        strcat(command, command_words[i]);
     }
-    else if (WIFEXITED(status)) // normal exit - display exit status
+    strcat(command, "\n");
+    size_t command_len = strlen(command);
+
+    int fd = client_connect(socket_path);
+    if (fd < 0) { return 1; }
+    if (client_wait_prompt(fd)) { fprintf(stderr, "myshell: session closed\n"); close(fd); return 1; }
+    int baseline_fd = -1;
+    if (baseline_path != NULL)
     {
-        printf("myshell: process %d exited normally with status %d.\n", pid, WEXITSTATUS(status));
-        return 0;
-    } 
-    else if (WIFSIGNALED(status)) // abnormal exit - display signal that caused termination
+        baseline_fd = client_connect(baseline_path);
+        if (baseline_fd < 0) { close(fd); return 1; }
+        if (client_wait_prompt(baseline_fd)) { fprintf(stderr, "myshell: session closed\n"); close(fd); close(baseline_fd); return 1; }
+    }
+
+    // warm both sessions up, then time tracing off, the baseline and tracing on in alternating blocks so drift in
+    // the machine is spread over all of them instead of landing on whichever ran first
+    int bench_ret = bench_commands(fd, command, runs / 10 + 1, NULL) ||
+                    (baseline_fd >= 0 && bench_commands(baseline_fd, command, runs / 10 + 1, NULL));
+    double off = 0;
+    double traced = 0;
+    double baseline = 0;
+    int rounds = runs < 10 ? runs : 10;
+    for (int round = 0; round < rounds && !bench_ret; round++)
     {
-        printf("myshell: process %d exited abnormally with signal %d: %s\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-        return 0;
-    } 
-    else
+        int block = runs / rounds + (round < runs % rounds);
+        bench_ret = bench_commands(fd, command, block, &off) ||
+                    (baseline_fd >= 0 && bench_commands(baseline_fd, command, block, &baseline)) ||
+                    bench_commands(fd, "trace on /dev/null\n", 1, NULL) ||
+                    bench_commands(fd, command, block, &traced) ||
+                    bench_commands(fd, "trace off\n", 1, NULL);
+    }
+    close(fd);
+    if (baseline_fd >= 0) { close(baseline_fd); }
+    if (bench_ret)
     {
-        printf("myshell: process %d exited in unknown state\n", pid);
+        fprintf(stderr, "myshell: session closed during the benchmark\n");
         return 1;
     }
-}
-// wait for specified child to finish: basically the same function as above but different system call and different error messages
-int wait_for_specific_process(pid_t child_pid)
-{
-    int status;
-    pid_t pid = waitpid(child_pid, &status, 0);
-    if (pid < 0)
+    double warm = off / runs;
+    traced /= runs;
+    baseline /= runs;
+
+    double start = monotonic_seconds();
+    for (int i = 0; i < runs; i++)
     {
-        if (errno == ECHILD)
+        int input[2];
+        if (pipe(input) < 0)
         {
-            printf("myshell: no child with such PID.\n");
-            return 0;
+            fprintf(stderr, "myshell: unable to create pipe: %s\n", strerror(errno));
+            return 1;
         }
-        else
+        pid_t pid = fork();
+        if (pid < 0)
         {
-            fprintf(stderr, "myshell: unable to wait for child with PID %d: %s\n", child_pid, strerror(errno));
+            fprintf(stderr, "myshell: unable to fork: %s\n", strerror(errno));
+            return 1;
+        }
+        if (pid == 0) // a cold shell reading the command from the pipe with its output thrown away
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(input[0], STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(input[0]);
+            close(input[1]);
+            execl("/proc/self/exe", "myshell", (char *)NULL);
             exit(1);
         }
+        close(input[0]);
+        write_all(input[1], command, command_len);
+        close(input[1]);
+        waitpid(pid, NULL, 0);
     }
-    else if (WIFEXITED(status)) 
-    {
-        printf("myshell: process %d exited normally with status %d.\n", pid, WEXITSTATUS(status));
-        return 0;
-    } 
-    else if (WIFSIGNALED(status)) 
-    {
-        printf("myshell: process %d exited abnormally with signal %d: %s\n", pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-        return 0;
-    } 
-    else
-    {
-        printf("myshell: process %d exited in unknown state\n", pid);
-        return 1;
-    }
-}
-
-int kill_process(pid_t pid)
-{
-    //send SIGKILL to process
-    int kill_ret = kill(pid, 15);
-    if (kill_ret < 0)
+    double cold = (monotonic_seconds() - start) / runs;
+    printf("bench: %s", command);
+    printf("bench: session %.1f us per command, cold start %.1f us per command (%.1fx faster)\n",
+            warm * 1e6, cold * 1e6, warm > 0 ? cold / warm : 0);
+    if (baseline_fd >= 0)
     {
-        fprintf(stderr, "kill: unable to kill process %d: %s\n", pid, strerror(errno));
-        return 1;
+        printf("bench: spans compiled out %.1f us per command, compiled in with tracing off %+.1f%% against that\n",
+                baseline * 1e6, baseline > 0 ? (warm - baseline) / baseline * 100 : 0);
     }
-    printf("kill: successfully able to kill process with PID %d\n", pid);
+    printf("bench: session with tracing on %.1f us per command (%+.1f%% against tracing off, the cost of recording)\n",
+            traced * 1e6, warm > 0 ? (traced - warm) / warm * 100 : 0);
     return 0;
 }
 
-int main()
+// read and run commands from stdin until EOF or quit
+void shell_loop()
 {
     while (1)
     {
         char input_buff[1024]; // buffer to store user command
         char *words[129]; // array of buffers to store individual arguments
-        printf("\033[0;32mmyshell>\033[0;0m "); // print myshell prompt
+        log_flush(); // make sure output from the last command is written before the prompt
+        printf(PROMPT); // print myshell prompt
         fflush(stdout);
         if (fgets(input_buff, 1024, stdin) == NULL) // if we have reached EOF
         {
             break;
         }
         if (!strcmp(input_buff, "\n")){continue;} // special case for when user types nothing and presses enter
+        if (input_buff[0] == '!') // !N runs entry N from the history again, !! runs the last one
+        {
+            uint64_t number = input_buff[1] == '!' ? history_last() : strtoull(input_buff + 1, NULL, 10);
+            if (history_get(number, input_buff))
+            {
+                fprintf(stderr, "myshell: %s: event not found\n", strtok(input_buff, " \t\n"));
+                continue;
+            }
+            printf("%s\n", input_buff);
+        }
+        history_add(input_buff);
         words[0] = strtok(input_buff, " \t\n"); // tokenize command to run
         int nwords = 0;
         while (words[nwords] != NULL) // keep tokenizing while there are args to parse
@@ -586,6 +4692,7 @@ int main()
             }
             words[nwords] = strtok(0, " \t\n");
         }
+        if (glob_expand_words(words, &nwords)) { continue; }
         // now we check for each command the user could have entered one after the other
         // we also check that the number of arguments they enter makes sense, and otherwise doesn't accept the command
         if (!strcmp(words[0], "list")) 
@@ -617,12 +4724,146 @@ int main()
         }
         else if (!strcmp(words[0], "copy"))
         {
-            if (nwords != 3)
+            if (nwords > 1 && !strcmp(words[1], "--profile"))
+            {
+                if (nwords > 3 || (nwords == 3 && strcmp(words[2], "reset")))
+                {
+                    fprintf(stderr, "Error: copy --profile takes no arguments or reset\n");
+                    continue;
+                }
+                copy_profile_command(nwords == 3);
+                continue;
+            }
+            // leading options pick what kind of copy this is
+            int first_arg = 1;
+            int pack_mode = 0; // 1 to pack into a single file, 2 to unpack one
+            int compress_mode = 0;
+            int dry_run = 0;
+            int show_progress = 0;
+            int watch = 0;
+            int ordered = 0;
+            int parallel = 0;
+            int bad_option = 0;
+            while (first_arg < nwords && !strncmp(words[first_arg], "--", 2))
+            {
+                if (!strcmp(words[first_arg], "--pack")) { pack_mode = 1; }
+                else if (!strcmp(words[first_arg], "--unpack")) { pack_mode = 2; }
+                else if (!strcmp(words[first_arg], "--compress")) { compress_mode = COPY_COMPRESS; }
+                else if (!strcmp(words[first_arg], "--decompress")) { compress_mode = COPY_DECOMPRESS; }
+                else if (!strcmp(words[first_arg], "--dry-run")) { dry_run = 1; }
+                else if (!strcmp(words[first_arg], "--progress")) { show_progress = 1; }
+                else if (!strcmp(words[first_arg], "--watch")) { watch = 1; }
+                else if (!strcmp(words[first_arg], "--ordered")) { ordered = 1; }
+                else if (!strcmp(words[first_arg], "--parallel")) { parallel = 1; }
+                else
+                {
+                    fprintf(stderr, "Error: unknown copy option %s\n", words[first_arg]);
+                    bad_option = 1;
+                    break;
+                }
+                first_arg++;
+            }
+            if (bad_option) { continue; }
+            int num_sources = nwords - first_arg - 1; // more than one source copies them all into the last argument
+            if (num_sources < 1)
+            {
+                fprintf(stderr, "Error: copy requires a source and a destination\n");
+                continue;
+            }
+            if (num_sources > 1 && (watch || ordered || pack_mode))
+            {
+                fprintf(stderr, "Error: copy --watch, --ordered, --pack and --unpack only accept two arguments\n");
+                continue;
+            }
+            if (compress_mode && watch) // the mirror compares sizes to find changed files, compressed copies never match
+            {
+                fprintf(stderr, "Error: copy --compress and --decompress can not be used with --watch\n");
+                continue;
+            }
+            if (show_progress && (watch || ordered || pack_mode))
+            {
+                fprintf(stderr, "Error: copy --progress can not be used with --watch, --ordered, --pack or --unpack\n");
+                continue;
+            }
+            if (dry_run && pack_mode == 2)
+            {
+                fprintf(stderr, "Error: copy --dry-run can not be used with --unpack\n");
+                continue;
+            }
+            // a plain copy into an existing directory lands at dest/name, however many sources there are
+            struct stat dest_stat;
+            int into_dir = num_sources > 1 || (!watch && !ordered && !pack_mode &&
+                                              stat(words[nwords - 1], &dest_stat) == 0 && S_ISDIR(dest_stat.st_mode));
+            int copy_ret;
+            du_totals totals = {0};
+            copy_progress progress = {0};
+            if (dry_run || show_progress) // size up the sources first with the same scan du uses
+            {
+                int du_ret = 0;
+                int first_source = pack_mode == 1 ? first_arg + 1 : first_arg; // --pack takes the pack file first
+                int last_source = pack_mode == 1 ? nwords : nwords - 1;
+                for (int i = first_source; i < last_source && !du_ret; i++)
+                {
+                    du_totals source_totals;
+                    du_ret = du_tree("copy", words[i], &source_totals, 0, NULL, NULL);
+                    totals.num_dirs += source_totals.num_dirs;
+                    totals.num_files += source_totals.num_files;
+                    totals.file_bytes += source_totals.file_bytes;
+                    totals.allocated_bytes += source_totals.allocated_bytes;
+                }
+                if (du_ret)
+                {
+                    fprintf(stderr, "copy unsuccessful\n");
+                    continue;
+                }
+                progress.total_bytes = totals.file_bytes;
+                progress.total_files = totals.num_files;
+                progress.start = monotonic_seconds();
+            }
+            if (dry_run)
             {
-                fprintf(stderr, "Error: copy only accepts two arguments\n");
+                char sources[32];
+                snprintf(sources, sizeof(sources), "%d sources", num_sources);
+                if (pack_mode == 1)
+                {
+                    printf("copy: would pack %llu directories, %llu files, and %llu bytes (%llu allocated) from %s into %s\n",
+                            (unsigned long long)totals.num_dirs, (unsigned long long)totals.num_files,
+                            (unsigned long long)totals.file_bytes, (unsigned long long)totals.allocated_bytes,
+                            words[first_arg + 1], words[first_arg]);
+                    continue;
+                }
+                printf("copy: would copy %llu directories, %llu files, and %llu bytes (%llu allocated) from %s to %s\n",
+                        (unsigned long long)totals.num_dirs, (unsigned long long)totals.num_files,
+                        (unsigned long long)totals.file_bytes, (unsigned long long)totals.allocated_bytes,
+                        num_sources > 1 ? sources : words[first_arg], words[nwords - 1]);
                 continue;
             }
-            if(treecopy(words[1], words[2]))
+            if (into_dir)
+            {
+                copy_ret = treecopy_batch(&words[first_arg], num_sources, words[nwords - 1], compress_mode, parallel,
+                                          show_progress ? &progress : NULL);
+            }
+            else if (watch)
+            {
+                copy_ret = watch_tree(words[first_arg], words[first_arg + 1]);
+            }
+            else if (ordered)
+            {
+                copy_ret = ordered_treecopy(words[first_arg], words[first_arg + 1], compress_mode);
+            }
+            else if (pack_mode == 1)
+            {
+                copy_ret = pack_tree(words[first_arg], words[first_arg + 1], compress_mode == COPY_COMPRESS);
+            }
+            else if (pack_mode == 2) // compressed packs are detected when unpacking
+            {
+                copy_ret = unpack_tree(words[first_arg], words[first_arg + 1]);
+            }
+            else
+            {
+                copy_ret = treecopy(words[first_arg], words[first_arg + 1], compress_mode, show_progress ? &progress : NULL);
+            }
+            if (copy_ret)
             {
                 fprintf(stderr, "copy unsuccessful\n");
             }
@@ -672,8 +4913,104 @@ int main()
             }
             kill_process(atoi(words[1]));
         }
+        else if (!strcmp(words[0], "du"))
+        {
+            int top_n = 0;
+            int first_arg = 1;
+            if (nwords > 2 && !strcmp(words[1], "-n"))
+            {
+                char *end;
+                errno = 0;
+                long n = strtol(words[2], &end, 10);
+                if (errno || end == words[2] || *end || n < 0)
+                {
+                    fprintf(stderr, "Error: du -n needs a non-negative number, not %s\n", words[2]);
+                    continue;
+                }
+                top_n = n > DU_MAX_TOP ? DU_MAX_TOP : n;
+                first_arg = 3;
+            }
+            if (nwords - first_arg > 1)
+            {
+                fprintf(stderr, "Error: du takes an optional -n count and at most one directory\n");
+                continue;
+            }
+            disk_usage(nwords > first_arg ? words[first_arg] : ".", top_n);
+        }
+        else if (!strcmp(words[0], "search"))
+        {
+            if (nwords < 2 || nwords > 3 || !words[1][0])
+            {
+                fprintf(stderr, "Error: search takes a pattern and an optional directory\n");
+                continue;
+            }
+            search_tree(words[1], nwords == 3 ? words[2] : ".");
+        }
+        else if (!strcmp(words[0], "status"))
+        {
+            if (nwords > 1)
+            {
+                fprintf(stderr, "Error: status does not accept arguments\n");
+                continue;
+            }
+            mirror_status();
+        }
+        else if (!strcmp(words[0], "trace"))
+        {
+            if (nwords == 3 && !strcmp(words[1], "on"))
+            {
+                trace_start(words[2]);
+            }
+            else if (nwords == 2 && !strcmp(words[1], "off"))
+            {
+                trace_stop();
+            }
+            else if (nwords == 1)
+            {
+                printf("trace: %s%s\n", trace_enabled ? "tracing to " : "off", trace_enabled ? trace_path : "");
+            }
+            else
+            {
+                fprintf(stderr, "Error: trace takes on FILE or off\n");
+            }
+        }
+        else if (!strcmp(words[0], "history"))
+        {
+            if (nwords > 2)
+            {
+                fprintf(stderr, "Error: history takes at most one prefix\n");
+                continue;
+            }
+            history_print(nwords == 2 ? words[1] : "");
+        }
+        else if (!strcmp(words[0], "verbosity"))
+        {
+            const char *level_names[] = {"quiet", "summary", "files"};
+            if (nwords > 2)
+            {
+                fprintf(stderr, "Error: verbosity takes at most one argument\n");
+                continue;
+            }
+            if (nwords == 1)
+            {
+                printf("verbosity: %s\n", level_names[log_level]);
+                continue;
+            }
+            int level;
+            for (level = LOG_QUIET; level <= LOG_FILES; level++)
+            {
+                if (!strcmp(words[1], level_names[level])) break;
+            }
+            if (level > LOG_FILES)
+            {
+                fprintf(stderr, "Error: verbosity must be quiet, summary or files\n");
+                continue;
+            }
+            log_level = level;
+        }
         else if (!strcmp(words[0], "quit") || !strcmp(words[0], "exit"))
         {
+            log_flush();
             exit(0);
         }
         else
@@ -681,5 +5018,32 @@ int main()
             printf("Unknown command: %s\n", words[0]);
         }
     }
+    log_flush();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "--serve"))
+    {
+        exit(serve(argv[2]));
+    }
+    if (argc >= 8 && !strcmp(argv[1], "--client") && !strcmp(argv[3], "--bench") && !strcmp(argv[5], "--baseline"))
+    {
+        exit(client_bench(argv[2], argv[6], atoi(argv[4]) > 0 ? atoi(argv[4]) : 1, &argv[7], argc - 7));
+    }
+    if (argc >= 6 && !strcmp(argv[1], "--client") && !strcmp(argv[3], "--bench"))
+    {
+        exit(client_bench(argv[2], NULL, atoi(argv[4]) > 0 ? atoi(argv[4]) : 1, &argv[5], argc - 5));
+    }
+    if (argc == 3 && !strcmp(argv[1], "--client"))
+    {
+        exit(client(argv[2]));
+    }
+    if (argc > 1)
+    {
+        fprintf(stderr, "usage: myshell [--serve SOCKET | --client SOCKET [--bench N [--baseline SOCKET] COMMAND...]]\n");
+        exit(1);
+    }
+    shell_loop();
     exit(0);
-}  
\ No newline at end of file
+}